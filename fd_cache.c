@@ -29,89 +29,379 @@
 static const char *VERSION __attribute__ ((used)) = "$Id$";
 
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE /* for O_PATH */
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include "fd_cache.h"
+#include "uring.h"
 #include "debug.h"
 
-fd_element *mem_pool;           /* contiguous memory space for descriptors */
-fd_element **fd_array = NULL;   /* array of pointers into mem_pool         */
-fd_element **fd_sort_array = NULL;/* same as fd_array, used for sorting    */
-int fd_num, fd_allocated;       /* fd_allocated starts at 0, upto fd_num */
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+/*
+ * A table of open descriptors: a hash table, chained, and a list from
+ * the most to the least recently used. When all the elements are in use
+ * the least recently used descriptor is closed to make room, so looking
+ * up, opening and closing are all O(1).
+ *
+ * There is one table for the log files and one for the directories they
+ * are in (a, a/b and a/b/vhost, see get_hash()), so that a new log file
+ * is opened with one openat() in its directory, without looking up the
+ * whole path again.
+ */
+typedef struct {
+    const char *name;
+    fd_element *pool;           /* contiguous memory space for descriptors */
+    fd_element **hash;          /* hash chains, by hash of the name        */
+    unsigned mask;
+    fd_element *first;          /* most recently used                      */
+    fd_element *last;           /* least recently used, closed first       */
+    fd_element *free;           /* unused elements, linked by lru_next     */
+    int num, allocated;         /* allocated starts at 0, upto num         */
+    unsigned long hits, misses, evictions;
+} fd_table;
+
+static fd_table files = { "files" }, dirs = { "directories" };
+
+/*
+ * Append buffers. A file has a buffer only while there is data in it;
+ * those files are linked from oldest to newest data. A buffer that is
+ * written is taken from its file and kept in retired until the write
+ * is done (buffers_written()).
+ */
+static int buffer_size = 0;
+static long buffer_total = WRITE_BUFFER_TOTAL * 1048576L;
+static long buffer_memory = 0;  /* allocated, retired included */
+static fd_element *oldest = NULL, *newest = NULL;
+static char **retired = NULL;
+static int retired_count = 0, retired_size = 0;
+static unsigned long buffer_flushes, pressure_flushes;
+
+static char *alloc_buffer(fd_element *file);
+
+/*
+ * gzip. A file has a z_stream while a member is open, that is exactly
+ * while it has an append buffer, so the members are finished when the
+ * buffers are flushed: when old enough, when the memory runs out, and
+ * when the file is closed (at rotation too). Their data is written as
+ * the buffer fills up, the buffer then starts over.
+ * GZIP_MEMORY is about what deflateInit2() allocates with the default
+ * window and memLevel, and counts against --write-buffer-total.
+ */
+#define GZIP_MEMORY (256 * 1024 + 8192)
+static int gzip_level = 0;
+static unsigned long gzip_members, gzip_in, gzip_out;
+
+/*
+ * Files closed at rotation are written to disk by SYNC_THREADS threads,
+ * one fdatasync() each, and closed when done; the writer goes on with
+ * the new files meanwhile. The descriptors waiting are still open, so
+ * there can only be sync_limit of them (out of the 20% not in the
+ * tables) besides the ones being synced; past that the writer waits.
+ */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static int *sync_fds;           /* ring of sync_limit descriptors    */
+static int sync_limit, sync_head, sync_count, sync_busy;
+static int sync_threads = 0;    /* started on the first rotation     */
+static unsigned long synced, sync_errors, sync_stalls;
+static int sync_max_pending;
+static double sync_total_ms, sync_max_ms;
 
 extern int debug;
-extern int detached;
 
 /*
- * Delete a file descriptor (+ name) from the list
+ * FNV-1a, as for the destinations in log_entry.c
+ */
+static inline unsigned hash_name(const char *name, int length) {
+    unsigned hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619;
+    }
+    return hash;
+}
+
+static inline void lru_unlink(fd_table *t, fd_element *e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        t->first = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        t->last = e->lru_prev;
+    }
+}
+
+static inline void lru_push(fd_table *t, fd_element *e) {
+    e->lru_prev = NULL;
+    e->lru_next = t->first;
+    if (t->first) {
+        t->first->lru_prev = e;
+    } else {
+        t->last = e;
+    }
+    t->first = e;
+}
+
+static double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0
+        + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Sync thread: write the queued files to disk and close them
+ */
+static void *sync_thread(void *arg) {
+    struct timespec start;
+    double ms;
+    int fd, failed;
+
+    pthread_mutex_lock(&sync_lock);
+    while (1) {
+        while (!sync_count) {
+            pthread_cond_wait(&sync_ready, &sync_lock);
+        }
+        fd = sync_fds[sync_head];
+        sync_head = (sync_head + 1) % sync_limit;
+        sync_count--;
+        sync_busy++;
+        pthread_mutex_unlock(&sync_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if ((failed = fdatasync(fd))) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "fdatasync(%d): %s", fd, LAST_ERROR);
+        }
+        close(fd);
+        ms = elapsed_ms(&start);
+
+        pthread_mutex_lock(&sync_lock);
+        sync_busy--;
+        synced++;
+        sync_errors += failed != 0;
+        sync_total_ms += ms;
+        if (ms > sync_max_ms) {
+            sync_max_ms = ms;
+        }
+        pthread_cond_broadcast(&sync_done);
+    }
+    return NULL;
+}
+
+/*
+ * Hand a descriptor to the sync threads, which close it
  */
-inline int delete_fd(int index) {
+static void sync_close(int fd) {
+    pthread_t thread;
+
+    pthread_mutex_lock(&sync_lock);
+    if (!sync_threads) {
+        if (!(sync_fds = (int*) malloc(sync_limit * sizeof(int)))) {
+            DIE_ERROR(6, ZONE, "could not allocate the sync queue");
+        }
+        for (; sync_threads < SYNC_THREADS; sync_threads++) {
+            if (pthread_create(&thread, NULL, sync_thread, NULL)) {
+                DIE_ERROR(6, ZONE, "pthread_create(sync): %s", LAST_ERROR);
+            }
+            pthread_detach(thread);
+        }
+    }
+    if (sync_count == sync_limit) {
+        sync_stalls++;
+        while (sync_count == sync_limit) {
+            pthread_cond_wait(&sync_done, &sync_lock);
+        }
+    }
+    sync_fds[(sync_head + sync_count++) % sync_limit] = fd;
+    if (sync_count + sync_busy > sync_max_pending) {
+        sync_max_pending = sync_count + sync_busy;
+    }
+    pthread_cond_signal(&sync_ready);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Wait for the sync threads to finish with all the files
+ */
+static void sync_wait(void) {
+    pthread_mutex_lock(&sync_lock);
+    while (sync_count || sync_busy) {
+        pthread_cond_wait(&sync_done, &sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+ * Close a descriptor and take it out of its table. With do_sync its
+ * data is written to disk first, in the background. Its buffer has to
+ * be flushed and written already, see delete_fd().
+ */
+static int remove_fd(fd_table *t, fd_element *e, int do_sync) {
+    fd_element **link;
+
     /* This is a critical zone (in case we plan to multithread) */
-    if (!fd_array[index]->fd) {
-        return fd_allocated;
+    if (!e->fd) {
+        return t->allocated;
+    }
+    if (do_sync) {
+        sync_close(e->fd);
+    } else {
+        close(e->fd);
     }
-    close(fd_array[index]->fd);
-    fd_array[index]->fd = 0;
-    fd_allocated--;
+
+    for (link = t->hash + (e->hash & t->mask); *link != e;
+         link = &(*link)->hash_next)
+        ;
+    *link = e->hash_next;
+    lru_unlink(t, e);
+    e->fd = 0;
+    e->lru_next = t->free;
+    t->free = e;
+    t->allocated--;
     if (DEBUG_MAX) {
-        LOG_PRINTF(DEBUG_MAX, ZONE, "delete_fd(%d, \"%s\"): %d remaining.",
-                   index, fd_array[index]->file, fd_allocated);
+        LOG_PRINTF(DEBUG_MAX, ZONE, "delete_fd(\"%s\"): %d %s remaining.",
+                   e->file, t->allocated, t->name);
     }
-    return fd_allocated;
+    return t->allocated;
+}
+
+/*
+ * Same, writing what is buffered first and waiting for the writes
+ * queued on it. To close several, flush them all and wait once.
+ */
+static int delete_fd(fd_table *t, fd_element *e, int do_sync) {
+    if (e->fd) {
+        flush_buffer(e);
+        uring_flush();
+        buffers_written();
+    }
+    return remove_fd(t, e, do_sync);
+}
+
+static void destroy_table(fd_table *t) {
+    while (t->first) {
+        delete_fd(t, t->first, 0);
+    }
+    free(t->hash);
+    t->hash = NULL;
+    free(t->pool);
+    t->pool = NULL;
+    t->free = NULL;
 }
 
 /*
  * delete descriptor array, close everything.
  */
 void destroy_fd_table(void) {
-    int i;
     /*
      * Make sure all files are closed
      */
     LOG_PRINTF(DEBUG_MED, ZONE, "destroy_fd_table(): called.");
 
-    if (fd_array) {
-        for (i = 0; i < fd_num; i++) {
-            delete_fd(i);
-        }
-    }
-    free(fd_array);
-    fd_array = NULL;
-    free(fd_sort_array);
-    fd_sort_array = NULL;
-    free(mem_pool);
-    mem_pool = NULL;
+    destroy_table(&files);
+    destroy_table(&dirs);
+    sync_wait();
 
     LOG_PRINTF(DEBUG_MED, ZONE,
                "destroy_fd_table(): data structures deallocated.");
 }
 
 /*
- * Close and reinitialize all descriptors older than age (unix time)
- * and optionally flush buffers
+ * Whether e is a log file called name (len bytes), in any directory
  */
-void close_fd_all(int do_sync, time_t age) {
-    int i;
+static inline int is_named(const fd_element *e, const char *name, int len) {
+    return e->fd && e->file_len > len
+        && e->file[e->file_len - len - 1] == '/'
+        && !memcmp(e->file + e->file_len - len, name, len);
+}
+
+/*
+ * Close and reinitialize the descriptors of the log files called name
+ * (in any directory) and optionally flush them to disk (in the
+ * background, see sync_thread()). The directories stay open.
+ */
+void close_fd_all(int do_sync, const char *name) {
+    struct timespec start;
+    int i, len, closed = 0;
     LOG_PRINTF(1, ZONE,
-               "close_fd_all(): closing all descriptors older than %d (total is %d).",
-               age, fd_allocated);
+               "close_fd_all(): closing all %s descriptors (total is %d).",
+               name, files.allocated);
 
-    if (fd_array) {
-        for (i = 0; i < fd_num; i++) {
-            if (fd_array[i]->time < age) {
-                delete_fd(i);
+    len = strlen(name);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (files.pool) {
+        /*
+         * Write the buffers of all of them together, then close them
+         */
+        for (i = 0; i < files.num; i++) {
+            if (is_named(files.pool + i, name, len)) {
+                flush_buffer(files.pool + i);
+                closed++;
+            }
+        }
+        if (closed) {
+            uring_flush();
+            buffers_written();
+        }
+        for (i = 0; i < files.num; i++) {
+            if (is_named(files.pool + i, name, len)) {
+                remove_fd(&files, files.pool + i, do_sync);
             }
         }
     }
-    if (do_sync) {
-        LOG_PRINTF(DEBUG_MED, ZONE, "close_fd_all(): flushing buffers to disk.");
-        sync();
-        LOG_PRINTF(DEBUG_MAX, ZONE, "close_fd_all(): sync complete.");
+    LOG_PRINTF(DEBUG_MIN, ZONE, "close_fd_all(): %d files closed in %.1f ms%s",
+               closed, elapsed_ms(&start),
+               (do_sync && closed) ? ", syncing in the background" : "");
+}
+
+static void init_table(fd_table *t, int num) {
+    unsigned size;
+    int i;
+
+    t->num = (num < 1) ? 1 : num;
+    t->allocated = 0;
+    /*
+     * At most half full, so the chains are short
+     */
+    for (size = 16; size < 2 * (unsigned) t->num; size *= 2)
+        ;
+    t->mask = size - 1;
+
+    t->pool = (fd_element*) calloc(t->num, sizeof(fd_element));
+    t->hash = (fd_element**) calloc(size, sizeof(fd_element*));
+
+    if (!t->pool || !t->hash) {
+        DIE_ERROR(6, ZONE, "could not allocate descriptor pool");
+    }
+
+    LOG_PRINTF(DEBUG_MIN, ZONE,
+               "init_fd_table(): %d cells for %s (%d+%d bytes) allocated.",
+               t->num, t->name, t->num * sizeof(fd_element),
+               size * sizeof(fd_element*));
+
+    /*
+     * All the elements start on the free list (fd = 0 is unallocated)
+     */
+    t->first = t->last = t->free = NULL;
+    for (i = t->num - 1; i >= 0; i--) {
+        t->pool[i].lru_next = t->free;
+        t->free = t->pool + i;
     }
 }
 
@@ -119,21 +409,20 @@ void close_fd_all(int do_sync, time_t age) {
  * Initialize descriptor array
  */
 void init_fd_table(void) {
-    int i;
+    int total, num_dirs;
     static int flag = 1;
 
     LOG_PRINTF(DEBUG_MED, ZONE, "init_fd_table(): initializing fd_table.");
 
-    fd_allocated = 0;
-    fd_num = getdtablesize();
-    fd_num = fd_num * 0.8; /* leave 20% for other uses */
-
-    mem_pool = (fd_element*) malloc(fd_num * sizeof(fd_element));
-    fd_array = (fd_element**) malloc(fd_num * sizeof(fd_element*));
-    fd_sort_array = (fd_element**) malloc(fd_num * sizeof(fd_element*));
+    total = getdtablesize();
+    total = total * 0.8; /* leave 20% for other uses */
+    num_dirs = total * DIR_CACHE / 100;
 
-    if (!mem_pool || !fd_array || !fd_sort_array) {
-        DIE_ERROR(6, ZONE, "could not allocate descriptor pool");
+    init_table(&files, total - num_dirs);
+    init_table(&dirs, num_dirs);
+    sync_limit = getdtablesize() / 10;
+    if (sync_limit < 1) {
+        sync_limit = 1;
     }
 
     /*
@@ -143,19 +432,6 @@ void init_fd_table(void) {
         atexit(destroy_fd_table);
         flag = 0;
     }
-
-    LOG_PRINTF(DEBUG_MIN, ZONE,
-               "init_fd_table(): %d cells (%d+2*%d bytes) allocated.",
-               fd_num, fd_num * sizeof(fd_element), fd_num * sizeof(fd_element*));
-
-    /*
-     * Now distribute chunks of the pool to individual elements
-     */
-    for (i = 0; i < fd_num; i++) {
-        fd_array[i] = mem_pool + i;
-        fd_array[i]->fd = 0; /* mark as unallocated */
-        fd_sort_array[i] = fd_array[i];
-    }
 }
 
 /*
@@ -164,33 +440,12 @@ void init_fd_table(void) {
  */
 
 /*
- * Comparison function for qsort()
- * use with:
- * qsort( fd_sort_array, fd_num, sizeof(fd_element*), compare_fd )
- */
-int compare_fd(const void *a, const void *b) {
-    return (((fd_element*) a)->time - ((fd_element*) b)->time);
-}
-
-/*
- * The hash function uses the sum of all characters modulo fd_num
- * if that slot is used, the next slots are tried in sequence.
- * Unused slots are marked with fd = 0
- */
-inline int get_fd_hash(char *filename) {
-    int hash;
-    for (hash = 0; *filename; filename++) {
-        hash += *filename;
-    }
-    return (hash % fd_num);
-}
-
-/*
- * Garbage collector. Deallocate least used descriptors;
- * gc_delete is a percentage number telling how much to delete 
+ * Garbage collector. Deallocate least recently used descriptors;
+ * gc_delete is a percentage number telling how much to delete
  * 100 to delete all, 0 to use the default (GC_DELETE)
  */
 void garbage_collect(int gc_delete) {
+    fd_element *e;
     int count;
 
     if (!gc_delete) {
@@ -200,100 +455,141 @@ void garbage_collect(int gc_delete) {
     /*
      * (optional) only do deallocation if table is full
      */
-    if (fd_allocated < fd_num) {
+    if (files.allocated < files.num) {
         return;
     }
 
-    LOG_PRINTF(DEBUG_MAX, ZONE, "garbage_collect(): called, sorting array.");
-
-    qsort(fd_sort_array, fd_num, sizeof(fd_element*), compare_fd);
     /*
-     * Note that changing the values pointed to by fd_sort_array
-     * will also change the fd_array ones since they share the same pointers
+     * Write the buffers of all of them together, then close them
      */
-    count = fd_num * gc_delete / 100;
-    for (count--; count >= 0; count--) {
-        delete_fd(count);
+    for (count = files.num * gc_delete / 100, e = files.last;
+         count > 0 && e; count--, e = e->lru_prev) {
+        flush_buffer(e);
+    }
+    uring_flush();
+    buffers_written();
+    for (count = files.num * gc_delete / 100; count > 0 && files.last;
+         count--) {
+        files.evictions++;
+        remove_fd(&files, files.last, 0);
     }
 
     LOG_PRINTF(DEBUG_MED, ZONE, "garbage_collect(): finished, %d deleted.",
-               fd_num * gc_delete / 100);
+               files.num * gc_delete / 100);
 }
 
 /*
- * Add a new file descriptor (+ name) to the list
- * Returns index in fd_array table
+ * Look up name (length bytes) in the table, and make it the most
+ * recently used. Returns NULL if it is not there.
  */
-int add_fd(int fd, char *filename) {
-    int pos, i, count;
-    pos = get_fd_hash(filename);
-
-    /*
-     * Look for an empty slot
-     */
-    for (i = pos, count = fd_num;
-         count && fd_array[i]->fd;
-         i = (i + 1) % fd_num, count--)
-        ;
-    if (count) {
-        /*
-         * Found an empty slot, fill it up.
-         * This is a critical zone (in case we plan to multithread)
-         */
-        fd_array[i]->time = time(NULL);
-        memcpy(fd_array[i]->file, filename, strlen(filename));
-        fd_array[i]->fd = fd;
+static fd_element *find_fd(fd_table *t, const char *name, int length,
+                           unsigned hash) {
+    fd_element *e;
 
-        fd_allocated++;
-
-        LOG_PRINTF(DEBUG_MAX, ZONE,
-                   "add_fd(%d, \"%s\"): hash %d, allocated %d.", fd, filename,
-                   pos, i);
+    for (e = t->hash[hash & t->mask]; e; e = e->hash_next) {
+        if (e->hash == hash && e->file_len == length
+            && !memcmp(e->file, name, length)) {
+            /*
+             * actualize hit
+             */
+            t->hits++;
+            e->time = time(NULL);
+            if (e != t->first) {
+                lru_unlink(t, e);
+                lru_push(t, e);
+            }
+            return e;
+        }
+    }
+    t->misses++;
+    return NULL;
+}
 
-        return i;
-    };
+/*
+ * Add a new file descriptor (+ name) to the table, closing the least
+ * recently used one if it is full
+ */
+static fd_element *add_fd(fd_table *t, int fd, const char *name,
+                          int length, unsigned hash) {
+    fd_element *e, **chain;
+
+    if (!t->free) {
+        LOG_PRINTF(DEBUG_MAX, ZONE, "add_fd(%d, \"%.*s\"): table full, "
+                   "closing %s.", fd, length, name, t->last->file);
+        t->evictions++;
+        delete_fd(t, t->last, 0);
+    }
     /*
-     * This should only happen if fd_allocated is 0
+     * This is a critical zone (in case we plan to multithread)
      */
-    LOG_PRINTF(DEBUG_MED, ZONE, "add_fd(%d, \"%s\"): table full.", fd, filename);
-
-    garbage_collect(0);
-    return add_fd(fd, filename); /* let's be recursive */
+    e = t->free;
+    t->free = e->lru_next;
+
+    e->fd = fd;
+    e->time = time(NULL);
+    memcpy(e->file, name, length);
+    e->file[length] = '\0';
+    e->file_len = length;
+    e->hash = hash;
+    chain = t->hash + (hash & t->mask);
+    e->hash_next = *chain;
+    *chain = e;
+    lru_push(t, e);
+    t->allocated++;
+
+    LOG_PRINTF(DEBUG_MAX, ZONE, "add_fd(%d, \"%s\"): hash %x, %d %s.",
+               fd, e->file, hash, t->allocated, t->name);
+
+    return e;
 }
 
 /*
- * Make sure that specified path exists (by creating its elements eventually)
- * the path is in the format aaa/bbb/ccc/something
- * the file mentioned is not created (is ignored).
+ * Descriptor of the directory path (length bytes, without the final
+ * '/'; path[length] is '\0'), which is created if it does not exist.
+ * The parents are looked up the same way, so only the levels that are
+ * not in the cache are opened. Returns -1 on error.
  */
-int make_path(char *path) {
-    char *pos;
-    static struct stat stat_buf;
-    int length, left;
-
-    length = left = strlen(path);
-    pos = path;
-
-    while ((pos = memchr(pos, '/', left))) {
-        *pos = '\0';
-        if (!stat(path, &stat_buf)) {
-            if (!S_ISDIR(stat_buf.st_mode)) {
-                DIE_ERROR(7, ZONE, "%s is not a directory!", path);
-            }
-        } else {
-            if (mkdir(path, 0755)) {
-                DIE_ERROR(7, ZONE, "mkdir( %s ): %s", path, LAST_ERROR);
-            }
-        }
-        LOG_PRINTF(DEBUG_MAX, ZONE, "make_path: created dir %s", path);
-
-        *pos++ = '/';
-        left = length - (pos - path);
+static int get_dir(char *path, int length) {
+    fd_element *e;
+    char *name;
+    int parent, fd;
+    unsigned hash;
+
+    if (!length) {
+        return AT_FDCWD; /* the spool, see write_log_process() */
+    }
+    hash = hash_name(path, length);
+    if ((e = find_fd(&dirs, path, length, hash))) {
+        return e->fd;
     }
 
-    LOG_PRINTF(DEBUG_MED, ZONE, "make_path: done with %s", path);
+    for (name = path + length; name > path && name[-1] != '/'; name--)
+        ;
+    if (name > path) {
+        name[-1] = '\0';
+        parent = get_dir(path, name - path - 1);
+        name[-1] = '/';
+    } else {
+        parent = AT_FDCWD;
+    }
+    if (parent == -1) {
+        return -1;
+    }
 
-    return 0;
+    while ((fd = openat(parent, name, O_PATH|O_DIRECTORY)) < 0) {
+        if (errno != ENOENT) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "get_dir(%s): open: %s", path,
+                       LAST_ERROR);
+            return -1;
+        }
+        if (mkdirat(parent, name, 0755) && errno != EEXIST) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "get_dir(%s): mkdir: %s", path,
+                       LAST_ERROR);
+            return -1;
+        }
+        LOG_PRINTF(DEBUG_MAX, ZONE, "get_dir: created dir %s", path);
+    }
+    return add_fd(&dirs, fd, path, length, hash)->fd;
 }
 
 /*
@@ -302,69 +598,337 @@ int make_path(char *path) {
  * This is the function that's supposed to be called from the outside.
  */
 int get_fd(char *filename) {
-    int pos, i, length, count, fd;
-    static int pos_last = -1, pos_cache;
-
-    pos = get_fd_hash(filename);
-    if (fd_array[pos]->fd) {
-        /*
-         * If we have reached this position last time make a jump to
-         * the position that was found previously. Chances are it's the
-         * same file requested.
-         */
-        if (pos == pos_last) {
-            pos = pos_cache;
-        } else {
-            pos_last = pos;
-        }
-
-        length = strlen(filename);
-        /*
-         * Scan from this point on to find my file. Chances are it's
-         * right here.
-         */
-        for (i = pos, count = fd_num; count && memcmp(fd_array[i]->file,
-                filename, length); i = (i + 1) % fd_num, count--)
-            ;
+    fd_element *file = get_file(filename);
 
-        if (count) {
-            /*
-             * actualize hit
-             */
-            fd_array[i]->time = time(NULL);
-            pos_cache = i;
+    return file ? file->fd : 0;
+}
 
-            LOG_PRINTF(DEBUG_MAX, ZONE,
-                       "get_fd(\"%s\"): returning %d (pos %d).", filename,
-                       fd_array[i]->fd, i);
+fd_element *get_file(char *filename) {
+    fd_element *e;
+    char dir[PATH_SIZE], *name;
+    int length, dir_len, dir_fd, count, fd;
+    unsigned hash;
 
-            return fd_array[i]->fd;
-        }
+    length = strlen(filename);
+    if (length >= PATH_SIZE) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    hash = hash_name(filename, length);
+    if ((e = find_fd(&files, filename, length, hash))) {
+        LOG_PRINTF(DEBUG_MAX, ZONE, "get_fd(\"%s\"): returning %d.",
+                   filename, e->fd);
+        return e;
     }
+
     /*
-     * Couldn't find it in the list, try to open file now
+     * Couldn't find it in the table, open it in its directory
      */
-    count = 2;
-    while (count) {
-        fd = open(filename, O_CREAT|O_WRONLY|O_APPEND|O_LARGEFILE, 0644);
-        if (fd > 0) {
-            pos_cache = add_fd(fd, filename);
-            return fd;
-        } else {
+    name = strrchr(filename, '/');
+    dir_len = name ? name - filename : 0;
+    name = name ? name + 1 : filename;
+    memcpy(dir, filename, dir_len);
+    dir[dir_len] = '\0';
+
+    for (count = 2; count; count--) {
+        if ((dir_fd = get_dir(dir, dir_len)) != -1) {
+            fd = openat(dir_fd, name, O_CREAT|O_WRONLY|O_APPEND|O_LARGEFILE,
+                        0644);
+            if (fd > 0) {
+                return add_fd(&files, fd, filename, length, hash);
+            }
             if (errno == EMFILE || errno == ENFILE) {
                 /*
                  * we should not reach here
                  */
-                DIE_ERROR(7, ZONE, "get_fd(%s): open: %s", filename, LAST_ERROR);
-            } else {
-                if (--count) {
-                    make_path(filename);
-                } else {
-                    DIE_ERROR(7, ZONE, "get_fd(%s): open: %s", filename, LAST_ERROR);
-                }
+                DIE_ERROR(7, ZONE, "get_fd(%s): open: %s", filename,
+                          LAST_ERROR);
             }
         }
+        if (errno != ENOENT || !dir_len) {
+            break;
+        }
+        /*
+         * A directory was removed since it was opened; forget them all
+         * so that the path is looked up (and made) again
+         */
+        while (dirs.first) {
+            delete_fd(&dirs, dirs.first, 0);
+        }
     }
-    pos_last = -1;
+    DIE_ERROR(7, ZONE, "get_fd(%s): open: %s", filename, LAST_ERROR);
+    return NULL;
+}
+
+/*
+ * Append buffers from here on
+ */
+
+static long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void fd_buffer_config(int size, int age, long total) {
+    buffer_size = size;
+    buffer_total = (total < size) ? size : total;
+    if (size) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "append buffers: %d bytes per file, "
+                   "%d ms, %ld bytes total", size, age, buffer_total);
+    }
+}
+
+int fd_gzip_config(int level) {
+#ifdef HAVE_LIBZ
+    gzip_level = level;
+    LOG_PRINTF(DEBUG_MIN, ZONE, "gzip: level %d", level);
     return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Queue the data in the buffer of e for writing and keep the buffer in
+ * retired until it is written
+ */
+static void retire_buffer(fd_element *e) {
+    if (e->buf_len) {
+        uring_write(e->fd, e->buf, e->buf_len);
+    }
+    if (retired_count == retired_size) {
+        retired_size = retired_size ? retired_size * 2 : 64;
+        if (!(retired = (char**) realloc(retired,
+                                         retired_size * sizeof(char*)))) {
+            DIE_ERROR(6, ZONE, "could not allocate buffer list");
+        }
+    }
+    retired[retired_count++] = e->buf;
+    e->buf = NULL;
+    e->buf_len = 0;
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Compress into the buffer of e, which is written and replaced when full.
+ * Returns what deflate() does.
+ */
+static int gzip_deflate(fd_element *e, int flush) {
+    z_stream *z = e->gz;
+    int result;
+
+    if (e->buf_len == buffer_size) {
+        retire_buffer(e);
+        if (!(e->buf = alloc_buffer(e))) {
+            DIE_ERROR(6, ZONE, "could not allocate gzip buffer");
+        }
+    }
+    z->next_out = (Bytef*) e->buf + e->buf_len;
+    z->avail_out = buffer_size - e->buf_len;
+    result = deflate(z, flush);
+    e->buf_len = buffer_size - z->avail_out;
+    return result;
+}
+
+/*
+ * Finish the member of e: what is written so far can be decompressed
+ */
+static void gzip_finish(fd_element *e) {
+    z_stream *z = e->gz;
+
+    while (gzip_deflate(e, Z_FINISH) != Z_STREAM_END)
+        ;
+    gzip_members++;
+    gzip_in += z->total_in;
+    gzip_out += z->total_out;
+    deflateEnd(z);
+    free(z);
+    e->gz = NULL;
+    buffer_memory -= GZIP_MEMORY;
+}
+#endif
+
+/*
+ * Queue the data in the buffer of e for writing and take the buffer away
+ */
+void flush_buffer(fd_element *e) {
+#ifdef HAVE_LIBZ
+    if (e->gz) {
+        gzip_finish(e);
+    }
+#endif
+    if (!e->buf) {
+        return;
+    }
+    retire_buffer(e);
+    buffer_flushes++;
+
+    if (e->buf_prev) {
+        e->buf_prev->buf_next = e->buf_next;
+    } else {
+        oldest = e->buf_next;
+    }
+    if (e->buf_next) {
+        e->buf_next->buf_prev = e->buf_prev;
+    } else {
+        newest = e->buf_prev;
+    }
+}
+
+void buffers_written(void) {
+    int i;
+
+    for (i = 0; i < retired_count; i++) {
+        free(retired[i]);
+    }
+    buffer_memory -= (long) retired_count * buffer_size;
+    retired_count = 0;
+}
+
+/*
+ * Get a new buffer for file (its gzip buffers too, when one fills up).
+ * When the memory is all used, the oldest buffers are written first.
+ */
+static char *alloc_buffer(fd_element *file) {
+    long need = buffer_size + ((gzip_level && !file->gz) ? GZIP_MEMORY : 0);
+    fd_element *e, *next;
+    char *buf;
+
+    /*
+     * flush_buffer() only retires the buffer, its memory is freed when
+     * the write is done: flush until the rest fits, then wait once.
+     * The file itself may be in the middle of a gzip member.
+     */
+    for (e = oldest; e && buffer_memory - (long) retired_count * buffer_size
+                          + need > buffer_total; e = next) {
+        next = e->buf_next;
+        if (e != file) {
+            pressure_flushes++;
+            flush_buffer(e);
+        }
+    }
+    if (buffer_memory + need > buffer_total) {
+        uring_flush();
+        buffers_written();
+    }
+    if ((buf = (char*) malloc(buffer_size))) {
+        buffer_memory += buffer_size;
+    }
+    return buf;
+}
+
+/*
+ * The file just got a buffer: it goes last in the list
+ */
+static void buffer_link(fd_element *file) {
+    file->buf_since = now_ms();
+    file->buf_next = NULL;
+    file->buf_prev = newest;
+    if (newest) {
+        newest->buf_next = file;
+    } else {
+        oldest = file;
+    }
+    newest = file;
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Compress the data into the current member of the file, starting one
+ * if needed
+ */
+static void gzip_writev(fd_element *file, const struct iovec *iov,
+                        int count) {
+    z_stream *z = file->gz;
+    int i;
+
+    if (!z) {
+        z = (z_stream*) calloc(1, sizeof(z_stream));
+        if (!z || !(file->buf = alloc_buffer(file))
+            || deflateInit2(z, gzip_level, Z_DEFLATED, 15 + 16, 8,
+                            Z_DEFAULT_STRATEGY) != Z_OK) {
+            DIE_ERROR(6, ZONE, "could not start gzip for %s", file->file);
+        }
+        buffer_memory += GZIP_MEMORY;
+        file->gz = z;
+        buffer_link(file);
+    }
+    for (i = 0; i < count; i++) {
+        z->next_in = (Bytef*) iov[i].iov_base;
+        z->avail_in = iov[i].iov_len;
+        while (z->avail_in) {
+            gzip_deflate(file, Z_NO_FLUSH);
+        }
+    }
+}
+#endif
+
+void file_writev(fd_element *file, const struct iovec *iov, int count,
+                 unsigned len) {
+    int i;
+
+#ifdef HAVE_LIBZ
+    if (gzip_level) {
+        gzip_writev(file, iov, count);
+        return;
+    }
+#endif
+    if (file->buf && file->buf_len + len > buffer_size) {
+        flush_buffer(file);
+    }
+    if (len > buffer_size || (!file->buf && !(file->buf = alloc_buffer(file)))) {
+        flush_buffer(file);
+        uring_writev(file->fd, iov, count, len);
+        return;
+    }
+    if (!file->buf_len) {
+        buffer_link(file);
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(file->buf + file->buf_len, iov[i].iov_base, iov[i].iov_len);
+        file->buf_len += iov[i].iov_len;
+    }
+    if (file->buf_len == buffer_size) {
+        flush_buffer(file);
+    }
+}
+
+void flush_buffers(int age) {
+    long now = now_ms();
+
+    while (oldest && (!age || now - oldest->buf_since >= age)) {
+        flush_buffer(oldest);
+    }
+}
+
+static void table_stats(fd_table *t) {
+    LOG_PRINTF(0, ZONE, "Stats: fd cache (%s): %d open, %lu hits, "
+               "%lu misses, %lu evictions", t->name, t->allocated,
+               t->hits, t->misses, t->evictions);
+}
+
+void fd_cache_stats(void) {
+    table_stats(&files);
+    table_stats(&dirs);
+    if (buffer_size) {
+        LOG_PRINTF(0, ZONE, "Stats: append buffers: %lu written, %lu early "
+                   "(memory), %ld bytes in use", buffer_flushes,
+                   pressure_flushes, buffer_memory);
+    }
+    pthread_mutex_lock(&sync_lock);
+    if (synced || sync_count || sync_busy) {
+        LOG_PRINTF(0, ZONE, "Stats: rotation sync: %lu files, %.1f ms avg, "
+                   "%.1f ms max, %d pending now, %d max (limit %d), "
+                   "%lu stalls, %lu errors", synced,
+                   synced ? sync_total_ms / synced : 0.0, sync_max_ms,
+                   sync_count + sync_busy, sync_max_pending, sync_limit,
+                   sync_stalls, sync_errors);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    if (gzip_level) {
+        LOG_PRINTF(0, ZONE, "Stats: gzip: %lu members, %lu bytes compressed "
+                   "to %lu", gzip_members, gzip_in, gzip_out);
+    }
 }
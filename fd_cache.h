@@ -34,15 +34,62 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include "logger.h" /* for PATH_SIZE */
 
 /* What percentage of the fds have to be deleted from table on GarbageCol */
 #define GC_DELETE 20 /* 20% */
 
-typedef struct {
+/* What percentage of the fds are for directories (see fd_cache.c) */
+#ifndef DIR_CACHE
+#define DIR_CACHE 10 /* 10% */
+#endif
+
+/*
+ * Append buffers (--write-buffer): size of the buffer of each file,
+ * how long data can wait in it and the total memory for all buffers.
+ * Buffering is off by default.
+ */
+#ifndef WRITE_BUFFER_AGE
+#define WRITE_BUFFER_AGE 1000     /* ms */
+#endif
+#ifndef WRITE_BUFFER_TOTAL
+#define WRITE_BUFFER_TOTAL 64     /* MB */
+#endif
+
+/*
+ * Threads writing to disk the files closed at rotation (see fd_cache.c)
+ */
+#ifndef SYNC_THREADS
+#define SYNC_THREADS 4
+#endif
+
+/*
+ * Compressed log files (--gzip): every file is a series of gzip members,
+ * each one finished after GZIP_FLUSH ms (--gzip-flush) and decodable by
+ * itself. The compressed data goes through the append buffers, which
+ * are GZIP_BUFFER KB unless --write-buffer says otherwise.
+ */
+#ifndef GZIP_FLUSH
+#define GZIP_FLUSH 10000          /* ms */
+#endif
+#ifndef GZIP_BUFFER
+#define GZIP_BUFFER 64            /* KB */
+#endif
+
+typedef struct _fd_element {
     int fd;
-    time_t time;
+    time_t time;                /* last used                        */
     char file[PATH_SIZE];
+    int file_len;
+    unsigned hash;
+    struct _fd_element *hash_next;           /* same hash chain      */
+    struct _fd_element *lru_prev, *lru_next; /* most recently used first */
+    char *buf;                  /* append buffer, if any            */
+    int buf_len;
+    long buf_since;             /* ms, when the data was buffered   */
+    struct _fd_element *buf_prev, *buf_next; /* in order of buf_since */
+    struct z_stream_s *gz;      /* gzip member being written, if any */
 } fd_element;
 
 /*
@@ -58,13 +105,15 @@ void init_fd_table(void);
  */
 void destroy_fd_table(void);
 /*
- * Close all descriptors older than age and optionally flush buffers (sync(2)).
+ * Close the descriptors of the log files called name, in any directory
+ * (their gzip members are finished) and optionally write them to disk,
+ * fdatasync(2) in the background.
  */
-void close_fd_all(int sync, time_t age);
+void close_fd_all(int sync, const char *name);
 /*
- * Do garbage collection. Argument is fractional, subunitary, specifies
- * how much to delete (0.1 for 10%, 1 for all). Use 0 to use default
- * defined above (GC_DELETE)
+ * Do garbage collection: close the least recently used descriptors, if
+ * the table is full. Argument is a percentage, how much to delete (100
+ * for all). Use 0 to use default defined above (GC_DELETE)
  */
 void garbage_collect(int gc_delete);
 /*
@@ -73,5 +122,43 @@ void garbage_collect(int gc_delete);
  * Returns 0 if file could not be opened
  */
 int get_fd(char *filename);
+/*
+ * Same as get_fd() but returns the cache entry, or NULL
+ */
+fd_element *get_file(char *filename);
+
+/*
+ * Set up the append buffers: size bytes per file (0 disables them), age
+ * in ms, total in bytes.
+ */
+void fd_buffer_config(int size, int age, long total);
+/*
+ * Compress the files with gzip at level (1-9), before fd_buffer_config().
+ * Returns -1 if zlib is not available.
+ */
+int fd_gzip_config(int level);
+/*
+ * Append the count buffers in iov (len bytes) to the file. They go to
+ * its append buffer or are queued for writing (see uring.h).
+ */
+void file_writev(fd_element *file, const struct iovec *iov, int count,
+                 unsigned len);
+/*
+ * Queue the data in the append buffer of the file for writing (and
+ * finish its gzip member)
+ */
+void flush_buffer(fd_element *file);
+/*
+ * Write out the buffers with data older than age ms (0 for all)
+ */
+void flush_buffers(int age);
+/*
+ * To be called after uring_flush(), releases the buffers written
+ */
+void buffers_written(void);
+/*
+ * Log the cache and append buffer counters
+ */
+void fd_cache_stats(void);
 
 #endif
@@ -0,0 +1,627 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Log format compiler. The LogFormat strings are parsed once:
+ *
+ * The input format (what the clients send) becomes a table of fields,
+ * each with the log_entry member it goes to. Only the fields that the
+ * output format or the server need are split and converted; scanning
+ * stops after the last of them.
+ *
+ * The output format becomes an array of operations (copy this literal,
+ * append that field) so that formatting an entry is a walk through the
+ * array with no format string to interpret. The timestamp is formatted
+ * once per second per thread.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+static const char *VERSION __attribute__ ((used)) = "$Id$";
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "format.h"
+#include "scan.h"
+#include "wire.h"
+#include "debug.h"
+
+/* fields and operations */
+enum {
+    OP_LITERAL,
+    OP_SKIP,            /* input field we have no use for (%t, ...) */
+    OP_HOSTIP,          /* %h %a */
+    OP_REMOTE_USER,     /* %l    */
+    OP_USER,            /* %u    */
+    OP_TIME,            /* %t    */
+    OP_REQUEST,         /* %r    */
+    OP_METHOD,          /* %m    */
+    OP_URI,             /* %U    */
+    OP_PROTO,           /* %H    */
+    OP_STATUS,          /* %s    */
+    OP_BYTES_CLF,       /* %b, "-" for none */
+    OP_BYTES,           /* %B, 0 for none   */
+    OP_VHOST,           /* %v %V */
+    OP_DURATION,        /* %D, microseconds */
+    OP_DURATION_SEC,    /* %T, seconds      */
+    OP_REFERRER,        /* %{Referer}i    */
+    OP_USER_AGENT,      /* %{User-agent}i */
+    OP_HEADER,          /* %{...}i, any other request header */
+    OP_TYPES
+};
+
+typedef struct {
+    int type;
+    const char *text;   /* OP_LITERAL */
+    int len;            /* OP_LITERAL length, OP_HEADER index */
+} format_op;
+
+static format_op ops[FORMAT_OPS];
+static int op_count = 0;
+
+/*
+ * Input fields. Only the first input_split are looked at.
+ */
+typedef struct {
+    int type;
+    int header;         /* OP_HEADER index */
+    int used;           /* needed by the output or the server */
+} input_field;
+
+static input_field fields[FORMAT_OPS];
+static int field_count = 0;
+static int input_split = 0;
+static int has_status = 0;
+/* names of the OP_HEADER fields, by index */
+static char *header_names[MAX_HEADERS];
+static int header_count = 0;
+
+/*
+ * Timestamp of the last second formatted, per formatter thread
+ */
+static __thread time_t stamp_time = -1;
+static __thread char stamp[TIMESTAMP_SIZE + 1];
+static __thread int stamp_len;
+
+/*
+ * Parse the directive at *pos (just after the '%') and advance *pos past
+ * it. Returns the OP_ type, with the name of %{name}i headers in
+ * name/name_len, or -1 with a message in error.
+ */
+static int parse_directive(const char **pos, const char **name, int *name_len,
+                           char *error, int size) {
+    const char *p = *pos;
+    int type;
+
+    /* %>s, %<s: we only have the final status anyways */
+    if (*p == '>' || *p == '<') {
+        p++;
+    }
+    *name = NULL;
+    *name_len = 0;
+    if (*p == '{') {
+        *name = ++p;
+        while (*p && *p != '}') {
+            p++;
+        }
+        if (!*p) {
+            snprintf(error, size, "missing '}' in \"%s\"", *name - 2);
+            return -1;
+        }
+        *name_len = p++ - *name;
+    }
+
+    switch (*p) {
+    case 'h': case 'a': type = OP_HOSTIP; break;
+    case 'l': type = OP_REMOTE_USER; break;
+    case 'u': type = OP_USER; break;
+    case 't': type = OP_TIME; break;
+    case 'r': type = OP_REQUEST; break;
+    case 'm': type = OP_METHOD; break;
+    case 'U': type = OP_URI; break;
+    case 'H': type = OP_PROTO; break;
+    case 's': type = OP_STATUS; break;
+    case 'b': type = OP_BYTES_CLF; break;
+    case 'B': type = OP_BYTES; break;
+    case 'v': case 'V': type = OP_VHOST; break;
+    case 'D': type = OP_DURATION; break;
+    case 'T': type = OP_DURATION_SEC; break;
+    case 'i':
+        if (!*name) {
+            snprintf(error, size, "%%i needs a header name");
+            return -1;
+        }
+        if (*name_len == 7 && !strncasecmp(*name, "Referer", 7)) {
+            type = OP_REFERRER;
+        } else if (*name_len == 10 && !strncasecmp(*name, "User-agent", 10)) {
+            type = OP_USER_AGENT;
+        } else {
+            type = OP_HEADER;
+        }
+        break;
+    case '%':
+        type = OP_LITERAL;
+        break;
+    default:
+        snprintf(error, size, "unknown directive %%%c", *p ? *p : ' ');
+        return -1;
+    }
+    if (*name && *p != 'i') {
+        snprintf(error, size, "%%{...}%c is not supported", *p);
+        return -1;
+    }
+    *pos = p + 1;
+    return type;
+}
+
+/*
+ * Index of the input header called name, or -1
+ */
+static int find_header(const char *name, int len) {
+    int i;
+
+    for (i = 0; i < header_count; i++) {
+        if (!strncasecmp(header_names[i], name, len) && !header_names[i][len]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int input_compile(const char *spec, char *error, int size) {
+    const char *pos = spec, *name;
+    int name_len, type;
+
+    field_count = header_count = has_status = 0;
+    while (*pos) {
+        if (*pos != '%') {
+            snprintf(error, size, "expected a directive at \"%s\"", pos);
+            return -1;
+        }
+        pos++;
+        if ((type = parse_directive(&pos, &name, &name_len, error, size)) < 0) {
+            return -1;
+        }
+        if (field_count == FORMAT_OPS) {
+            snprintf(error, size, "too many fields (max %d)", FORMAT_OPS);
+            return -1;
+        }
+        if (type == OP_LITERAL) {
+            snprintf(error, size, "%%%% is not a field");
+            return -1;
+        }
+        if (type == OP_TIME) {
+            type = OP_SKIP; /* entries are stamped when received */
+        }
+        if (type == OP_STATUS) {
+            has_status = 1;
+        }
+        fields[field_count].type = type;
+        fields[field_count].used = 0;
+        if (type == OP_HEADER) {
+            if (header_count == MAX_HEADERS) {
+                snprintf(error, size, "too many headers (max %d)", MAX_HEADERS);
+                return -1;
+            }
+            fields[field_count].header = header_count;
+            header_names[header_count++] = strndup(name, name_len);
+        }
+        field_count++;
+
+        /*
+         * Fields are separated by a tab, either as is or as "\t"
+         */
+        if (*pos == LOG_FIELD_SEPARATOR) {
+            pos++;
+        } else if (pos[0] == '\\' && pos[1] == 't') {
+            pos += 2;
+        } else if (*pos) {
+            snprintf(error, size, "expected a tab at \"%s\"", pos);
+            return -1;
+        }
+    }
+    for (type = 0; type < field_count; type++) {
+        if (fields[type].type == OP_VHOST) {
+            break;
+        }
+    }
+    if (type == field_count) {
+        snprintf(error, size, "%%v is required");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add one operation to the compiled format
+ */
+static int add_op(int type, const char *text, int len,
+                  char *error, int size) {
+    if (op_count == FORMAT_OPS) {
+        snprintf(error, size, "too many directives (max %d)", FORMAT_OPS);
+        return -1;
+    }
+    ops[op_count].type = type;
+    ops[op_count].text = text;
+    ops[op_count].len = len;
+    op_count++;
+    return 0;
+}
+
+/*
+ * Mark the input fields the output and the server need, and how far
+ * into the line we have to go to get them
+ */
+static void input_mark_used(void) {
+    int need[OP_TYPES], need_header[MAX_HEADERS];
+    int i, type;
+
+    memset(need, 0, sizeof(need));
+    memset(need_header, 0, sizeof(need_header));
+    need[OP_VHOST] = need[OP_STATUS] = 1; /* file name, filtering */
+    for (i = 0; i < op_count; i++) {
+        need[ops[i].type] = 1;
+        if (ops[i].type == OP_HEADER) {
+            need_header[ops[i].len] = 1;
+        }
+    }
+    need[OP_REQUEST] |= need[OP_METHOD] | need[OP_URI] | need[OP_PROTO];
+    need[OP_BYTES_CLF] = need[OP_BYTES] = need[OP_BYTES_CLF] | need[OP_BYTES];
+    need[OP_DURATION] = need[OP_DURATION_SEC] =
+        need[OP_DURATION] | need[OP_DURATION_SEC];
+
+    input_split = 0;
+    for (i = 0; i < field_count; i++) {
+        type = fields[i].type;
+        fields[i].used = (type == OP_HEADER)
+            ? need_header[fields[i].header] : need[type];
+        if (fields[i].used) {
+            input_split = i + 1;
+        }
+    }
+    LOG_PRINTF(DEBUG_MED, ZONE, "input format: %d fields, %d used",
+               field_count, input_split);
+}
+
+int format_compile(const char *spec, char *error, int size) {
+    const char *pos, *name, *literal;
+    int name_len, type, arg;
+
+    spec = strdup(spec); /* literals point into it */
+    op_count = 0;
+    literal = spec;
+    for (pos = spec; *pos; ) {
+        if (*pos != '%') {
+            pos++;
+            continue;
+        }
+        if (pos > literal
+            && add_op(OP_LITERAL, literal, pos - literal, error, size)) {
+            return -1;
+        }
+        pos++;
+        if ((type = parse_directive(&pos, &name, &name_len, error, size)) < 0) {
+            return -1;
+        }
+        arg = 1; /* text is "%" for %% */
+        if (type == OP_HEADER) {
+            if ((arg = find_header(name, name_len)) < 0) {
+                snprintf(error, size, "header %%{%.*s}i is not in the input "
+                         "format", name_len, name);
+                return -1;
+            }
+        }
+        if (add_op(type, pos - 1, arg, error, size)) {
+            return -1;
+        }
+        literal = pos;
+    }
+    if (pos > literal
+        && add_op(OP_LITERAL, literal, pos - literal, error, size)) {
+        return -1;
+    }
+    LOG_PRINTF(DEBUG_MED, ZONE, "output format \"%s\": %d operations",
+               spec, op_count);
+    input_mark_used();
+    return 0;
+}
+
+/*
+ * Reset the fields of an entry before parsing into it. Entries are
+ * reused, and the fields the input format doesn't have must not keep
+ * the pointers of an earlier line.
+ */
+static inline void clear_entry(log_entry *rec) {
+    memset(&rec->hostip, 0,
+           offsetof(log_entry, logline) - offsetof(log_entry, hostip));
+    if (!has_status) {
+        rec->status = 200;
+    }
+    rec->bytes = (unsigned) -1;
+    rec->duration = (unsigned) -1;
+}
+
+int input_parse(log_entry *rec, int length) {
+    char *line = rec->logline, *field, *request;
+    /* end of each field */
+    int end[FORMAT_OPS], req[2];
+    int i, n, start;
+
+    n = scan_sep(line, length, LOG_FIELD_SEPARATOR, end, input_split);
+    if (n < input_split) {
+        /* the last field may be followed by a separator, or not */
+        if (input_split < field_count || n < input_split - 1) {
+            return 0;
+        }
+        end[n] = length;
+    }
+    clear_entry(rec);
+
+    for (i = 0, start = 0; i < input_split; start = end[i++] + 1) {
+        if (!fields[i].used) {
+            continue;
+        }
+        field = line + start;
+        line[end[i]] = '\0';
+
+        switch (fields[i].type) {
+        case OP_HOSTIP:      rec->hostip = field; break;
+        case OP_REMOTE_USER: rec->remote_user = field; break;
+        case OP_USER:        rec->user = field; break;
+        case OP_METHOD:      rec->method = field; break;
+        case OP_URI:         rec->uri = field; break;
+        case OP_PROTO:       rec->proto = field; break;
+        case OP_VHOST:       rec->vhost = field; break;
+        case OP_REFERRER:    rec->referrer = field; break;
+        case OP_USER_AGENT:  rec->user_agent = field; break;
+        case OP_HEADER:      rec->headers[fields[i].header] = field; break;
+
+        case OP_STATUS:
+            rec->status = parse_status(field, end[i] - start);
+            break;
+
+        case OP_BYTES_CLF:
+        case OP_BYTES:
+            rec->bytes = parse_bytes(field, end[i] - start);
+            break;
+
+        case OP_DURATION:
+            rec->duration = parse_uint(field, end[i] - start);
+            break;
+
+        case OP_DURATION_SEC:
+            rec->duration = parse_uint(field, end[i] - start) * 1000000;
+            break;
+
+        case OP_REQUEST:
+            /*
+             * Looks like "GET /something HTTP/1.0"
+             */
+            request = field;
+            if (scan_sep(request, end[i] - start, ' ', req, 2) < 2) {
+                return 0;
+            }
+            request[req[0]] = '\0';
+            request[req[1]] = '\0';
+            rec->method = request;
+            rec->uri = request + req[0] + 1;
+            rec->proto = request + req[1] + 1;
+            break;
+        }
+    }
+    return 1;
+}
+
+int input_decode(log_entry *rec, wire_reader *r) {
+    char *out = rec->logline, *end = rec->logline + MSG_SIZE, *request;
+    int req[2];
+    unsigned count, i;
+    int len, match = 1;
+    wire_value v;
+
+    if (wire_get_uint(r, &count)) {
+        return -1;
+    }
+    if (count < (unsigned) input_split) {
+        match = 0;
+    }
+    *out = '\0';
+    clear_entry(rec);
+
+    for (i = 0; i < count; i++) {
+        if (wire_next(r, &v)) {
+            return -1;
+        }
+        if (!match || i >= (unsigned) input_split || !fields[i].used) {
+            continue;
+        }
+
+        /*
+         * The numbers are there already, everything else is copied to
+         * the logline as text
+         */
+        if (v.tag == WIRE_UINT) {
+            switch (fields[i].type) {
+            case OP_STATUS:
+                rec->status = v.number;
+                continue;
+            case OP_BYTES_CLF:
+            case OP_BYTES:
+                rec->bytes = v.number;
+                continue;
+            case OP_DURATION:
+                rec->duration = v.number;
+                continue;
+            case OP_DURATION_SEC:
+                rec->duration = v.number * 1000000;
+                continue;
+            }
+        }
+        if ((len = wire_text(&v, out, end - out)) < 0) {
+            match = 0;
+            continue;
+        }
+
+        switch (fields[i].type) {
+        case OP_HOSTIP:      rec->hostip = out; break;
+        case OP_REMOTE_USER: rec->remote_user = out; break;
+        case OP_USER:        rec->user = out; break;
+        case OP_METHOD:      rec->method = out; break;
+        case OP_URI:         rec->uri = out; break;
+        case OP_PROTO:       rec->proto = out; break;
+        case OP_VHOST:       rec->vhost = out; break;
+        case OP_REFERRER:    rec->referrer = out; break;
+        case OP_USER_AGENT:  rec->user_agent = out; break;
+        case OP_HEADER:      rec->headers[fields[i].header] = out; break;
+        case OP_STATUS:      rec->status = parse_status(out, len); break;
+
+        case OP_BYTES_CLF:
+        case OP_BYTES:
+            rec->bytes = parse_bytes(out, len);
+            break;
+
+        case OP_DURATION:
+            rec->duration = parse_uint(out, len);
+            break;
+
+        case OP_DURATION_SEC:
+            rec->duration = parse_uint(out, len) * 1000000;
+            break;
+
+        case OP_REQUEST:
+            request = out;
+            if (scan_sep(request, len, ' ', req, 2) < 2) {
+                match = 0;
+                break;
+            }
+            request[req[0]] = '\0';
+            request[req[1]] = '\0';
+            rec->method = request;
+            rec->uri = request + req[0] + 1;
+            rec->proto = request + req[1] + 1;
+            break;
+        }
+        out += len + 1;
+    }
+    return match;
+}
+
+/*
+ * Append helpers. They never write past end.
+ */
+static inline char *append(char *out, char *end, const char *s, int len) {
+    if (len > end - out) {
+        len = end - out;
+    }
+    memcpy(out, s, len);
+    return out + len;
+}
+
+static inline char *append_str(char *out, char *end, const char *s) {
+    if (!s) {
+        s = "-";
+    }
+    while (*s && out < end) {
+        *out++ = *s++;
+    }
+    return out;
+}
+
+static inline char *append_uint(char *out, char *end, unsigned n) {
+    char digits[12], *p = digits + sizeof(digits);
+
+    if (n == (unsigned) -1) {
+        return append(out, end, "-", 1);
+    }
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    return append(out, end, p, digits + sizeof(digits) - p);
+}
+
+/*
+ * Formatted timestamp for t, cached for the current second
+ */
+static inline char *append_time(char *out, char *end, time_t t) {
+    if (t != stamp_time) {
+        mk_timestamp(t, stamp);
+        stamp_len = strlen(stamp);
+        stamp_time = t;
+    }
+    return append(out, end, stamp, stamp_len);
+}
+
+int format_line(const log_entry *rec, char *out, int size) {
+    char *pos = out, *end = out + size;
+    format_op *op;
+
+    for (op = ops; op < ops + op_count; op++) {
+        switch (op->type) {
+        case OP_LITERAL:     pos = append(pos, end, op->text, op->len); break;
+        case OP_HOSTIP:      pos = append_str(pos, end, rec->hostip); break;
+        case OP_REMOTE_USER: pos = append_str(pos, end, rec->remote_user); break;
+        case OP_USER:        pos = append_str(pos, end, rec->user); break;
+        case OP_TIME:        pos = append_time(pos, end, rec->time); break;
+        case OP_METHOD:      pos = append_str(pos, end, rec->method); break;
+        case OP_URI:         pos = append_str(pos, end, rec->uri); break;
+        case OP_PROTO:       pos = append_str(pos, end, rec->proto); break;
+        case OP_STATUS:      pos = append_uint(pos, end, rec->status); break;
+        case OP_VHOST:       pos = append_str(pos, end, rec->vhost); break;
+        case OP_REFERRER:    pos = append_str(pos, end, rec->referrer); break;
+        case OP_USER_AGENT:  pos = append_str(pos, end, rec->user_agent); break;
+        case OP_DURATION:    pos = append_uint(pos, end, rec->duration); break;
+        case OP_HEADER:
+            pos = append_str(pos, end, rec->headers[op->len]);
+            break;
+
+        case OP_REQUEST:
+            pos = append_str(pos, end, rec->method);
+            pos = append(pos, end, " ", 1);
+            pos = append_str(pos, end, rec->uri);
+            pos = append(pos, end, " ", 1);
+            pos = append_str(pos, end, rec->proto);
+            break;
+
+        case OP_BYTES_CLF:
+            if (!rec->bytes) {
+                pos = append(pos, end, "-", 1);
+                break;
+            }
+            pos = append_uint(pos, end, rec->bytes);
+            break;
+
+        case OP_BYTES:
+            pos = append_uint(pos, end,
+                              (rec->bytes == (unsigned) -1) ? 0 : rec->bytes);
+            break;
+
+        case OP_DURATION_SEC:
+            pos = append_uint(pos, end, (rec->duration == (unsigned) -1)
+                              ? rec->duration : rec->duration / 1000000);
+            break;
+        }
+    }
+    return pos - out;
+}
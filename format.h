@@ -0,0 +1,99 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Log formats. The input format (the LogFormat of the clients) and the
+ * output format are given as Apache LogFormat strings and compiled at
+ * startup, into a field table and a list of append operations.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef __FORMAT_H__
+#define __FORMAT_H__
+
+#include "logger.h"
+#include "wire.h"
+
+/*
+ * Default input format (--input-format), as in httpd-log.conf
+ */
+#ifndef INPUT_FORMAT
+#define INPUT_FORMAT "%a\t%l\t%u\t%s\t%b\t%v\t%r\t%{Referer}i\t%{User-agent}i"
+#endif
+
+/*
+ * Default output format (--format). Same as the Apache "combined"
+ * format except that %l is always "-".
+ */
+#ifndef OUTPUT_FORMAT
+#ifdef LOG_EXTENDED
+#define OUTPUT_FORMAT "%h - %u %t \"%r\" %>s %b \"%{Referer}i\" \"%{User-agent}i\""
+#else
+#define OUTPUT_FORMAT "%h - %u %t \"%r\" %>s %b"
+#endif
+#endif
+
+/*
+ * Maximum number of operations (or fields) in a compiled format
+ */
+#define FORMAT_OPS 64
+
+/*
+ * Compile the input format. It is a list of directives separated by tabs;
+ * %v is required. Has to be done before format_compile().
+ * Returns 0 on success or -1 with a message in error.
+ */
+int input_compile(const char *spec, char *error, int size);
+
+/*
+ * Compile the output format. Understands the directives
+ *   %h %a %l %u %t %r %m %U %H %s %>s %b %B %v %V %D %T %%
+ *   %{Referer}i %{User-agent}i %{...}i (headers in the input format)
+ * and literal text. Fields the input format does not have are written
+ * as "-" (%B as 0, %s as 200). Returns 0 on success or -1 with a
+ * message in error.
+ */
+int format_compile(const char *spec, char *error, int size);
+
+/*
+ * Split the line in rec->logline (length bytes) according to the input
+ * format and fill in the fields of rec that are used. Returns 0 if the
+ * line does not match the format.
+ */
+int input_parse(log_entry *rec, int length);
+
+/*
+ * Same for the next binary record in r (httpd-logger --binary), which has
+ * the fields of the input format. Returns 1, 0 if the record does not
+ * match the format, or -1 if it is not valid (the rest of the datagram
+ * cannot be read either).
+ */
+int input_decode(log_entry *rec, wire_reader *r);
+
+/*
+ * Format rec according to the compiled output format into out (at most
+ * size bytes, not terminated). Returns the length of the line.
+ * Safe to call from several threads.
+ */
+int format_line(const log_entry *rec, char *out, int size);
+
+#endif
@@ -10,8 +10,11 @@
  * Description:
  * Helper module to store data keyed on strings.
  *
- * It uses a fixed array with doubly linked lists as elements.
- * The simple hash function is the sum of all characters modulo hash size.
+ * It is an open addressing table with robin hood hashing. The keys are
+ * copied into a few large blocks (the arena) instead of one malloc()
+ * each. When the table gets 3/4 full it is resized incrementally: the
+ * keys are moved to the new table a few at a time, by the calls that
+ * follow, and looked up in both tables until then.
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -36,35 +39,277 @@ static const char *VERSION __attribute__ ((used)) = "$Id$";
 #include "debug.h"
 #include "hash.h"
 
-typedef struct _list_element {
-    struct _list_element *next;
-    struct _list_element *prev;
-    char *key;
+/*
+ * Keys are copied into blocks of this size (longer keys get a block of
+ * their own)
+ */
+#define ARENA_BLOCK 65536
+/*
+ * Slots of the old table moved to the new one by every call while
+ * resizing
+ */
+#define MIGRATE_STEP 16
+
+typedef struct _arena_block {
+    struct _arena_block *next;
+    unsigned int size;
+    unsigned int used;
+    char data[];
+} arena_block;
+
+typedef struct {
+    arena_block *blocks;
+    size_t bytes;       /* taken by keys, deleted ones included */
+    size_t live;        /* taken by the keys still in the hash  */
+} arena_t;
+
+typedef struct {
+    unsigned int hash;
+    unsigned int dist;  /* 0 if empty, else 1 + distance from hash slot */
+    char *key;          /* NULL for a deleted key in the old table      */
+    unsigned int key_len;
     void *value;
-} list_element;
+} slot_t;
+
+typedef struct {
+    slot_t *slots;
+    unsigned int mask;  /* number of slots - 1, a power of 2 - 1 */
+    unsigned int used;
+} table_t;
 
 typedef struct {
-    list_element *first;
-    int count;
-} hash_element;
+    table_t cur;
+    table_t old;        /* being moved to cur, if old.slots is set */
+    unsigned int next;  /* next slot of old to move                */
+    arena_t arena;      /* keys of cur                             */
+    arena_t old_arena;  /* keys of old                             */
+    arena_block *moved; /* room for the keys moved from old        */
+} hash_data;
+
+/*
+ * FNV-1a with a final mix, so that the low bits depend on all the key.
+ * Also returns the length of the key.
+ */
+static inline unsigned int hash_key(const char *key, unsigned int *length) {
+    unsigned int hash = 2166136261u;
+    const char *c;
+
+    for (c = key; *c; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619;
+    }
+    *length = c - key;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
 
 /*
- * Compute an index with sufficient dispersion over the entire array
- * Returns a number in the range [0..size-1]
+ * Copy a key into the arena. Returns NULL if out of memory.
  */
-unsigned int hash_func(const char * string, unsigned int size) {
-    unsigned int sum;
-    char c;
+static char *arena_copy(arena_t *arena, const char *key, unsigned int length) {
+    arena_block *block = arena->blocks;
+    unsigned int need = length + 1;
+    char *copy;
+
+    if (!block || block->used + need > block->size) {
+        unsigned int size = (need > ARENA_BLOCK) ? need : ARENA_BLOCK;
+
+        block = (arena_block*) malloc(sizeof(arena_block) + size);
+        if (!block) {
+            LOG_PRINTF(DEBUG_ERROR, ZONE, "hash: malloc(arena): %s",
+                       LAST_ERROR);
+            return NULL;
+        }
+        block->size = size;
+        block->used = 0;
+        if (need > ARENA_BLOCK && arena->blocks) {
+            /* keep filling the current block */
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    copy = block->data + block->used;
+    memcpy(copy, key, length);
+    copy[length] = '\0';
+    block->used += need;
+    arena->bytes += need;
+    arena->live += need;
+    return copy;
+}
+
+static void arena_free(arena_t *arena) {
+    arena_block *block;
+
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->bytes = arena->live = 0;
+}
+
+static int table_new(table_t *table, unsigned int size) {
+    table->slots = (slot_t*) calloc(size, sizeof(slot_t));
+    if (!table->slots) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "hash: malloc(%u slots): %s", size,
+                   LAST_ERROR);
+        return 0;
+    }
+    table->mask = size - 1;
+    table->used = 0;
+    return 1;
+}
 
-    sum = 0;
+/*
+ * Find a key. Robin hood hashing keeps every key at most as far from its
+ * hash slot as the keys it passes, so the search can stop at the first
+ * slot whose key is closer to home than this one would be.
+ */
+static slot_t *table_find(table_t *table, const char *key,
+                          unsigned int length, unsigned int hash) {
+    unsigned int i, dist;
+    slot_t *slot;
+
+    for (i = hash & table->mask, dist = 1; ; i = (i + 1) & table->mask, dist++) {
+        slot = table->slots + i;
+        if (slot->dist < dist) {
+            return NULL;
+        }
+        if (slot->hash == hash && slot->key && slot->key_len == length
+            && !memcmp(slot->key, key, length)) {
+            return slot;
+        }
+    }
+}
 
-    while ((c = *string++)) {
-        sum += (unsigned) c;
+/*
+ * Put a new key in the table, taking the place of keys that are closer
+ * to their hash slot
+ */
+static void table_place(table_t *table, slot_t entry) {
+    unsigned int i;
+    slot_t *slot, swap;
+
+    for (i = entry.hash & table->mask, entry.dist = 1; ;
+         i = (i + 1) & table->mask, entry.dist++) {
+        slot = table->slots + i;
+        if (!slot->dist) {
+            *slot = entry;
+            table->used++;
+            return;
+        }
+        if (slot->dist < entry.dist) {
+            swap = *slot;
+            *slot = entry;
+            entry = swap;
+        }
     }
+}
 
-    sum %= size;
+/*
+ * Take a key out by moving back the keys after it (no tombstones)
+ */
+static void table_remove(table_t *table, slot_t *slot) {
+    unsigned int i = slot - table->slots, next;
 
-    return sum;
+    for (;;) {
+        next = (i + 1) & table->mask;
+        if (table->slots[next].dist <= 1) {
+            break;
+        }
+        table->slots[i] = table->slots[next];
+        table->slots[i].dist--;
+        i = next;
+    }
+    memset(table->slots + i, 0, sizeof(slot_t));
+    table->used--;
+}
+
+/*
+ * Move up to steps slots of the old table to the new one, with their keys
+ * in the new arena. The old table and arena are freed at the end.
+ */
+static void migrate(hash_data *data, unsigned int steps) {
+    slot_t *slot, entry;
+
+    arena_block *moved = data->moved;
+
+    for (; steps && data->next <= data->old.mask; steps--) {
+        slot = data->old.slots + data->next++;
+        if (slot->dist && slot->key) {
+            /* moved has room for all of them, see start_resize() */
+            entry = *slot;
+            entry.key = moved->data + moved->used;
+            memcpy(entry.key, slot->key, slot->key_len + 1);
+            moved->used += slot->key_len + 1;
+            data->arena.bytes += slot->key_len + 1;
+            data->arena.live += slot->key_len + 1;
+            table_place(&data->cur, entry);
+            slot->key = NULL; /* only in cur from now on */
+        }
+    }
+    if (data->next > data->old.mask) {
+        LOG_PRINTF(DEBUG_MED, ZONE, "hash: resized to %u slots",
+                   data->cur.mask + 1);
+        free(data->old.slots);
+        data->old.slots = NULL;
+        arena_free(&data->old_arena);
+        /* behind the block that is being filled */
+        if (data->arena.blocks) {
+            moved->next = data->arena.blocks->next;
+            data->arena.blocks->next = moved;
+        } else {
+            moved->next = NULL;
+            data->arena.blocks = moved;
+        }
+        data->moved = NULL;
+    }
+}
+
+/*
+ * Start moving the keys to a new table of size slots. The keys are moved
+ * a few at a time by the calls that follow. Returns 0 if out of memory.
+ */
+static int start_resize(hash_t *hash, unsigned int size) {
+    hash_data *data = (hash_data*) hash->data;
+    arena_block *block;
+    size_t live = data->arena.live;
+
+    /*
+     * Set aside room for the keys that are moved, so that migrate()
+     * does not have to fail
+     */
+    block = (arena_block*) malloc(sizeof(arena_block) + live + 1);
+    if (!block) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "hash: malloc(arena): %s", LAST_ERROR);
+        return 0;
+    }
+    data->old = data->cur;
+    if (!table_new(&data->cur, size)) {
+        data->cur = data->old;
+        data->old.slots = NULL;
+        free(block);
+        return 0;
+    }
+    LOG_PRINTF(DEBUG_MED, ZONE, "hash: resizing %u keys to %u slots",
+               hash->count, size);
+
+    data->next = 0;
+    data->old_arena = data->arena;
+    data->arena.blocks = NULL;
+    data->arena.bytes = data->arena.live = 0;
+    block->size = live + 1;
+    block->used = 0;
+    block->next = NULL;
+    data->moved = block;
+    hash->size = size;
+    return 1;
 }
 
 /*
@@ -73,24 +318,28 @@ unsigned int hash_func(const char * string, unsigned int size) {
  */
 hash_t *hash_new(int size) {
     hash_t *hash;
-    hash_element *data;
+    hash_data *data;
+    unsigned int slots;
 
     if (size <= 0) {
         size = DEFAULT_HASH_SIZE;
     }
+    for (slots = 16; slots < (unsigned) size; slots *= 2)
+        ;
 
-    LOG_PRINTF(DEBUG_MED, ZONE, "hash.new(): creating hash of size %d", size);
+    LOG_PRINTF(DEBUG_MED, ZONE, "hash.new(): creating hash of size %u", slots);
 
     hash = (hash_t*) malloc(sizeof(hash_t));
-    data = (hash_element*) malloc(size * sizeof(hash_element));
-    if (!hash || !data) {
+    data = (hash_data*) calloc(1, sizeof(hash_data));
+    if (!hash || !data || !table_new(&data->cur, slots)) {
         LOG_PRINTF(DEBUG_ERROR, ZONE, "hash.new(): malloc(hash|data): %s",
                    LAST_ERROR);
+        free(hash);
+        free(data);
         return NULL;
     }
 
-    bzero(data, size * sizeof(hash_element));
-    hash->size = size;
+    hash->size = slots;
     hash->data = data;
     hash->count = 0;
 
@@ -98,22 +347,25 @@ hash_t *hash_new(int size) {
 }
 
 /*
- * Retrieve the list element containing the key or NULL
+ * Retrieve the slot containing the key or NULL, in either table
  */
-static void *_hash_get_list_elem(hash_t *hash, const char *key) {
-    hash_element *data;
-    list_element *cur;
-
-    data = (hash_element*) hash->data + hash_func(key, hash->size);
-    cur = data->first;
-
-    while (cur) {
-        if (!strcmp(key, cur->key)) {
-            break;
-        }
-        cur = cur->next;
+static slot_t *_hash_get_slot(hash_t *hash, const char *key,
+                              unsigned int *length, unsigned int *hashed,
+                              table_t **table) {
+    hash_data *data = (hash_data*) hash->data;
+    slot_t *slot;
+
+    *hashed = hash_key(key, length);
+    if (data->old.slots) {
+        migrate(data, MIGRATE_STEP);
+    }
+    *table = &data->cur;
+    slot = table_find(&data->cur, key, *length, *hashed);
+    if (!slot && data->old.slots) {
+        *table = &data->old;
+        slot = table_find(&data->old, key, *length, *hashed);
     }
-    return cur;
+    return slot;
 }
 
 /*
@@ -121,11 +373,13 @@ static void *_hash_get_list_elem(hash_t *hash, const char *key) {
  * Returns NULL if the key was not found.
  */
 void *hash_get(hash_t *hash, const char *key) {
-    list_element *cur;
+    unsigned int length, hashed;
+    table_t *table;
+    slot_t *slot;
 
-    cur = _hash_get_list_elem(hash, key);
+    slot = _hash_get_slot(hash, key, &length, &hashed, &table);
 
-    return (cur) ? cur->value : NULL;
+    return (slot) ? slot->value : NULL;
 }
 
 /*
@@ -133,82 +387,45 @@ void *hash_get(hash_t *hash, const char *key) {
  * Will return 0 on error (memory allocation problems)
  */
 int hash_insert(hash_t *hash, const char *key, void *value) {
-    hash_element *data;
-    list_element *cur, *prev, *new;
-    int result;
+    hash_data *data = (hash_data*) hash->data;
+    unsigned int length, hashed, size;
+    table_t *table;
+    slot_t *slot, entry;
 
-    result = hash_func(key, hash->size);
-    data = (hash_element*) hash->data + result;
+    if ((slot = _hash_get_slot(hash, key, &length, &hashed, &table))) {
 
-    LOG_PRINTF(DEBUG_MAX, ZONE, "hash.insert(): \"%s\" in bucket %d",
-               key, result);
-
-    cur = data->first;
-    prev = cur;
+        /* Key already exists, replace value */
 
-    /*
-     * Scan the list until our key becomes less than the list's, or we
-     * reach the end (the keys are ordered in each list).
-     */
+        LOG_PRINTF(DEBUG_MAX, ZONE, "hash.insert(): \"%s\": replaced value", key);
 
-    result = 1; /* just some value that's greater than zero */
-    while (cur && result > 0) {
-        result = strcmp(key, cur->key);
-        prev = cur;
-        cur = cur->next;
+        free(slot->value);
+        slot->value = value;
+        return 1;
     }
-    cur = prev; /* go back one */
-
-    /* result < 0 <=> key < cur->key so insert before cur */
-    /* result > 0 <=> key > cur->key so append after cur / create list head */
-
-    if (result != 0) {
-
-        /*
-         * We need to create a new element, either insert (if result > 0) or
-         * append at end of list (if result < 0, then cur == NULL).
-         */
-        new = (list_element*) malloc(sizeof(list_element));
-        if (!new) {
-            LOG_PRINTF(DEBUG_ERROR, ZONE,
-                       "hash.insert(): malloc(list_element): %s", LAST_ERROR);
-            return 0;
-        }
-        new->value = value;
-        new->key = strdup(key);
-
-        if (result < 0) { /* insert before cur. cur is defined. */
-            new->next = cur;
-            new->prev = cur->prev;
-            cur->prev = new;
-            if (new->prev) {
-                new->prev->next = new;
-            } else {
-                data->first = new; /* cur was the first element, update list head */
-            }
-        } else { /* append after cur / create list */
-            if (cur) {
-                new->next = cur->next;
-                cur->next = new;
-                new->prev = cur;
-            } else { /* create first element in list */
-                new->next = NULL;
-                new->prev = NULL;
-                data->first = new;
-            }
-        }
-        data->count++;
-        hash->count++;
-
-    } else {
 
-        /* Key already exists, replace value */
+    if (!data->old.slots) {
+        size = data->cur.mask + 1;
+        if ((data->cur.used + 1) * 4 > size * 3) {
+            /* more than 3/4 full */
+            start_resize(hash, size * 2);
+        } else if (data->arena.bytes - data->arena.live > ARENA_BLOCK
+                   && data->arena.bytes > 2 * data->arena.live) {
+            /* mostly deleted keys in the arena */
+            start_resize(hash, size);
+        }
+    }
 
-        LOG_PRINTF(DEBUG_MAX, ZONE, "hash.insert(): \"%s\": replaced value", key);
+    LOG_PRINTF(DEBUG_MAX, ZONE, "hash.insert(): \"%s\" at %u", key,
+               hashed & data->cur.mask);
 
-        free(cur->value);
-        cur->value = value;
+    entry.hash = hashed;
+    entry.key_len = length;
+    entry.value = value;
+    if (!(entry.key = arena_copy(&data->arena, key, length))) {
+        return 0;
     }
+    table_place(&data->cur, entry);
+    hash->count++;
 
     return 1;
 }
@@ -218,96 +435,93 @@ int hash_insert(hash_t *hash, const char *key, void *value) {
  * Returns 0 if key could not be found.
  */
 int hash_delete(hash_t *hash, const char *key) {
-    list_element *cur;
-    hash_element *data;
-
-    data = (hash_element*) hash->data + hash_func(key, hash->size);
+    hash_data *data = (hash_data*) hash->data;
+    unsigned int length, hashed;
+    table_t *table;
+    slot_t *slot;
 
     LOG_PRINTF(DEBUG_MAX, ZONE, "hash.delete(): \"%s\"", key);
 
-    cur = _hash_get_list_elem(hash, key);
+    slot = _hash_get_slot(hash, key, &length, &hashed, &table);
 
-    if (!cur) {
+    if (!slot) {
         return 0;
     }
 
-    /* Remove element from list */
-
-    if (cur->prev) { /* we are not in the first slot */
-
-        cur->prev->next = cur->next;
+    /* free the memory used by element */
 
+    free(slot->value);
+    if (table == &data->cur) {
+        data->arena.live -= length + 1;
+        table_remove(&data->cur, slot);
     } else {
-
-        data->first = cur->next;
-
+        /* the old table is being walked, just mark it deleted */
+        data->old_arena.live -= length + 1;
+        slot->key = NULL;
+        slot->value = NULL;
+        data->old.used--;
     }
-
-    data->count--;
     hash->count--;
 
-    /* free the memory used by element */
-
-    free(cur->value);
-    free(cur->key);
-    free(cur);
-
     return 1;
 }
 
-/*
- * Deallocate list recursively
- */
-static void _list_destroy(list_element *list) {
-    if (list) {
-        _list_destroy(list->next);
-        free(list->key);
-        free(list->value);
-        free(list);
-    } else {
+static void table_destroy(table_t *table) {
+    unsigned int i;
+
+    if (!table->slots) {
         return;
     }
+    for (i = 0; i <= table->mask; i++) {
+        if (table->slots[i].dist && table->slots[i].key) {
+            free(table->slots[i].value);
+        }
+    }
+    free(table->slots);
+    table->slots = NULL;
 }
 
 /*
  * deallocate entire hash
  */
 void hash_destroy(hash_t *hash) {
-    hash_element *data;
-    int i;
+    hash_data *data = (hash_data*) hash->data;
 
     LOG_PRINTF(DEBUG_MIN, ZONE, "hash.destroy(): deallocating memory.");
 
-    for (i = 0; i < hash->size; i++) {
-        data = (hash_element*) hash->data + i;
-        _list_destroy(data->first);
-    }
-    free(hash->data);
+    table_destroy(&data->cur);
+    table_destroy(&data->old);
+    arena_free(&data->arena);
+    arena_free(&data->old_arena);
+    free(data->moved);
+    free(data);
     free(hash);
 }
 
+static void table_dump(table_t *table, const char *name) {
+    slot_t *slot;
+    unsigned int i;
+
+    for (i = 0; i <= table->mask; i++) {
+        slot = table->slots + i;
+        if (slot->dist && slot->key) {
+            printf("  %s[%u] +%u: \"%s\"=\"%s\"\n", name, i, slot->dist - 1,
+                   slot->key, (char*) slot->value);
+        }
+    }
+}
+
 /*
  * (for debugging) print dump of hash structure
  */
 void hash_dump(hash_t *hash) {
-    list_element *cur;
-    hash_element *data;
-    unsigned int i;
+    hash_data *data = (hash_data*) hash->data;
 
-    printf("hash_dump(): %d buckets, %d keys total.\n", hash->size, hash->count);
+    printf("hash_dump(): %d slots, %d keys total%s.\n", hash->size,
+           hash->count, data->old.slots ? " (resizing)" : "");
 
-    for (i = 0; i < hash->size; i++) {
-        data = (hash_element*) hash->data + i;
-
-        if (data->count) {
-            printf("  [%d], %d keys: ", i, data->count);
-            cur = data->first;
-
-            while (cur) {
-                printf("\"%s\"=\"%s\" ", cur->key, (char*)cur->value);
-                cur = cur->next;
-            }
-            printf("\n");
-        }
+    table_dump(&data->cur, "");
+    if (data->old.slots) {
+        table_dump(&data->old, "old");
     }
 }
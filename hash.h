@@ -10,8 +10,7 @@
  * Description:
  * Helper module to store data keyed on strings.
  *
- * It uses a fixed array with linked lists as elements.
- * The simple hash function is the sum of all characters modulo hash size.
+ * It uses open addressing (robin hood) and grows as needed, see hash.c.
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -31,7 +30,7 @@
 #define DEFAULT_HASH_SIZE 256
 
 typedef struct {
-    unsigned int size;
+    unsigned int size;  /* number of slots                              */
     unsigned int count; /* number of valid keys in hash                  */
     void *data;         /* pointer to hash structure (defined in hash.c) */
 } hash_t;
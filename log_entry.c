@@ -38,17 +38,17 @@ static const char *VERSION __attribute__ ((used)) = "$Id$";
 #include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include "logger.h"
+#include "hash.h"
 #include "fd_cache.h"
+#include "format.h"
+#include "uring.h"
 #include "debug.h"
 
-char msg_raw[MSG_SIZE + PATH_SIZE + 2 * sizeof(unsigned)];
-/*
- * Read the description of the msg format in write_log_process()
- */
-char *path_buf = (msg_raw + sizeof(unsigned));
-char *msg_buf = (msg_raw + PATH_SIZE + 2 * sizeof(unsigned));
+char path_buf[PATH_SIZE + 1]; /* file name of the record being written */
 
 extern int day;     /* both defined in logserver.c */
 char log_file[32];
@@ -59,7 +59,11 @@ char log_file[32];
 
 extern int debug;
 extern int detach;
+extern int workers;
 extern int write_log[2];
+extern int use_uring;
+extern int write_buffer, write_buffer_age, write_buffer_total;
+extern int gzip_level, gzip_flush;
 extern char *logger_spool;
 
 /*
@@ -68,21 +72,20 @@ extern char *logger_spool;
 
 /*
  * Format time according to TIMESTAMP_FORMAT
- * second argument is either NULL to use timestamp global var,
- * or otherwise points to the buffer where the stamp will be written.
+ * second argument points to the buffer where the stamp will be written
+ * (TIMESTAMP_SIZE + 1 bytes). Safe to call from several threads.
+ * The zone offset is the one in effect at t, daylight saving included.
  */
-char timestamp[TIMESTAMP_SIZE + 1];
-inline void mk_timestamp(time_t t, char *where) {
+void mk_timestamp(time_t t, char *where) {
     int len, offset;
-    if (!where) {
-        where = timestamp;
-    }
-    strftime(where, TIMESTAMP_SIZE, TIMESTAMP_FORMAT, localtime(&t));
+    struct tm tm;
+
+    strftime(where, TIMESTAMP_SIZE, TIMESTAMP_FORMAT, localtime_r(&t, &tm));
 #ifdef APACHE_TZ
-    offset = timezone / 60; /* that is a global variable */
+    offset = tm.tm_gmtoff / 60;
     len = strlen(where);
     snprintf(where+len, TIMESTAMP_SIZE-len, "%c%.2d%.2d]",
-             (offset>0) ? '-' : '+', offset/60, offset % 60);
+             (offset < 0) ? '-' : '+', abs(offset) / 60, abs(offset) % 60);
 #endif
 }
 
@@ -118,78 +121,118 @@ void get_hash(char hashed[PATH_SIZE], char *name) {
 }
 
 /*
- * write to pipe (to write_log presumably)
+ * Interned virtual hosts, one table per formatter thread. A vhost gets
+ * an id and its path the first time it is seen; the path (a/b/vhost/
+ * and log_file) only has to be redone when log_file changes, which
+ * happens at rotation, for each vhost as it shows up again.
  */
-inline void my_pipe_write(int fd, const char *buf, int size) {
-    int sent, left;
-    left = size;
-    while ((sent = write(fd, buf + size - left, left)) < left) {
-        if (sent < 0){
-            DIE_ERROR(1, ZONE, "write(pipe=%d, buf, %d): %s",
-                               fd, left, LAST_ERROR);
-        } else {
-            /* wrote fewer than expected bytes, next write might block */
-            LOG_PRINTF(0, ZONE, "write(pipe, buf, %d): sent %d bytes.",
-                                left, sent);
-            left -= sent;
-        }
-    }
-}
+typedef struct {
+    int id;
+    unsigned gen;               /* log_gen the path was made for */
+    int dir_len;                /* a/b/vhost/                    */
+    int path_len;
+    char path[PATH_SIZE + 1];
+} vhost_t;
+
+static __thread hash_t *vhosts = NULL;
+static __thread char log_name[32];
+static __thread int log_len;
+static __thread unsigned log_gen = 0;
 
 /*
- * Process one log entry
+ * Returns the vhost with its path for log_file, or NULL if the path
+ * would be too long
  */
-void process_entry(log_entry *rec) {
-    int length;
-    char *tmp, *log;
+static vhost_t *intern_vhost(const char *name, const char *log_file) {
+    vhost_t *vhost;
 
-    /*
-     * this is a virtual host
-     */
-    get_hash(path_buf, rec->vhost);
+    if (strcmp(log_name, log_file)) {
+        log_len = strlen(log_file);
+        memcpy(log_name, log_file, log_len + 1);
+        log_gen++;
+    }
 
-    /*
-     * At this point we have the log entry record in rec and
-     * the path of the log file (not including the file itself) in path_buf
-     */
-    if (rec->status >= 200) {
+    if (!vhosts || vhosts->count >= VHOST_MAX) {
+        if (vhosts) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "%d vhosts, starting over",
+                       vhosts->count);
+            hash_destroy(vhosts);
+        }
+        if (!(vhosts = hash_new(VHOST_HASH_SIZE))) {
+            DIE_ERROR(6, ZONE, "could not allocate vhost table");
+        }
+    }
+
+    if (!(vhost = (vhost_t*) hash_get(vhosts, name))) {
+        if (strlen(name) + 5 > PATH_SIZE) {
+            return NULL;
+        }
+        if (!(vhost = (vhost_t*) malloc(sizeof(vhost_t)))) {
+            DIE_ERROR(6, ZONE, "could not allocate vhost");
+        }
+        vhost->id = vhosts->count;
+        get_hash(vhost->path, (char*) name);
+        vhost->dir_len = strlen(vhost->path);
+        vhost->gen = log_gen - 1;
+        if (!hash_insert(vhosts, name, vhost)) {
+            DIE_ERROR(6, ZONE, "could not allocate vhost");
+        }
+    }
+
+    if (vhost->gen != log_gen) {
         /*
-         * Begin prepare raw message for the log writer process.
-         * The format is [len]path[len]logline
+         * a/b/vhost/ + log_file has to fit in PATH_SIZE
          */
-        length = strlen(path_buf);
-        tmp = path_buf + length;
-        log = log_file;
-        for (; (*tmp = *log); tmp++, log++, length++)
-            ; /* strcat */
-        *(unsigned*) msg_raw = length;
-        msg_buf = path_buf + length + sizeof(unsigned);
-        mk_timestamp(rec->time, NULL);
-        snprintf(msg_buf, MSG_SIZE,
-#ifdef LOG_EXTENDED
-                "%s - %s %s \"%s %s %s\" %d %d \"%s\" \"%s\"",
-#else
-                "%s - %s %s \"%s %s %s\" %d %d",
-#endif
-                rec->hostip, rec->user, timestamp, rec->method, rec->uri,
-                rec->proto, rec->status, rec->bytes
-#ifdef LOG_EXTENDED
-        , rec->referrer, rec->user_agent
-#endif
-        );
-        length += sizeof(unsigned) * 2 +
-                  (*(unsigned*) (msg_buf - sizeof(unsigned)) = strlen(msg_buf));
+        if (vhost->dir_len + log_len > PATH_SIZE) {
+            return NULL;
+        }
+        memcpy(vhost->path + vhost->dir_len, log_name, log_len + 1);
+        vhost->path_len = vhost->dir_len + log_len;
+        vhost->gen = log_gen;
+    }
+    return vhost;
+}
 
-        my_pipe_write(write_log[1], msg_raw, length);
+/*
+ * Format one log entry as a REC_LINE record for the write_log process
+ * and store it at out, which has room for WRITE_LOG_REC_SIZE bytes.
+ * The path is built from the vhost and log_file (the log file name in
+ * effect when the entry was received); the line ends with a newline.
+ * Returns the size of the record, or 0 if the entry is discarded.
+ * Safe to call from several threads.
+ */
+int format_entry(log_entry *rec, const char *log_file, char *out) {
+    record_hdr *hdr = (record_hdr*) out;
+    vhost_t *vhost;
+    unsigned length;
+    char *path, *msg;
 
-        if (!detach) {
-            LOG_PRINTF(DEBUG_MED, ZONE, "calling write_log_process()...");
-            write_log_process(write_log);
-        }
-    } else {
+    if (!rec->status) { /* could not be parsed */
+        return 0;
+    }
+    if (rec->status < 200) {
         LOG_PRINTF(DEBUG_MAX, ZONE, "discarded %s %s (status %d)",
                    rec->method, rec->uri, rec->status);
+        return 0;
+    }
+    if (!(vhost = intern_vhost(rec->vhost, log_file))) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "discarded entry for vhost \"%.32s...\" "
+                   "(name too long)", rec->vhost);
+        return 0;
     }
+
+    path = out + sizeof(record_hdr);
+    length = vhost->path_len;
+    memcpy(path, vhost->path, length);
+    hdr->type = REC_LINE;
+    hdr->path_len = length;
+
+    msg = path + length;
+    length = format_line(rec, msg, MSG_SIZE - 1); /* see format.c */
+    msg[length++] = '\n';
+    hdr->line_len = length;
+
+    return REC_SIZE(hdr);
 }
 
 /*
@@ -197,41 +240,271 @@ void process_entry(log_entry *rec) {
  */
 
 /*
- * Read from the pipe.
- * It retries the read until it has all the data
+ * Lines of a frame grouped by destination file, so that each file gets
+ * all its lines with one writev(), in the order they came in.
+ * The records of a group are linked through line_next.
+ */
+#define FRAME_RECORDS (WRITE_LOG_FRAME_SIZE / sizeof(record_hdr))
+#define DEST_TABLE_SIZE (2 * FRAME_RECORDS) /* power of 2 */
+
+typedef struct {
+    char *path;         /* in the frame, not terminated */
+    int path_len;
+    int first, last;    /* records */
+    int count;
+    unsigned len;       /* bytes */
+    int slot;           /* in dest_table */
+} dest_group;
+
+static dest_group *groups;
+static int group_count;
+static int *dest_table;         /* group + 1, 0 is empty */
+static char **line_rec;         /* record of each line */
+static int *line_next;
+static int line_count;
+static struct iovec *frame_iov; /* for the writev()s of one frame */
+static int iov_used;
+
+/*
+ * Allocate the grouping tables (once)
+ */
+static void init_groups(void) {
+    groups = (dest_group*) malloc(FRAME_RECORDS * sizeof(dest_group));
+    dest_table = (int*) calloc(DEST_TABLE_SIZE, sizeof(int));
+    line_rec = (char**) malloc(FRAME_RECORDS * sizeof(char*));
+    line_next = (int*) malloc(FRAME_RECORDS * sizeof(int));
+    frame_iov = (struct iovec*) malloc(FRAME_RECORDS * sizeof(struct iovec));
+    if (!groups || !dest_table || !line_rec || !line_next || !frame_iov) {
+        DIE_ERROR(6, ZONE, "write_log: could not allocate frame tables");
+    }
+}
+
+/*
+ * Add the line in record hdr to the group of its file
+ */
+static void group_line(record_hdr *hdr) {
+    char *path = (char*) (hdr + 1);
+    unsigned hash = 2166136261u; /* FNV-1a */
+    dest_group *group;
+    int i, slot;
+
+    for (i = 0; i < hdr->path_len; i++) {
+        hash = (hash ^ (unsigned char) path[i]) * 16777619;
+    }
+    for (slot = hash & (DEST_TABLE_SIZE - 1); dest_table[slot];
+         slot = (slot + 1) & (DEST_TABLE_SIZE - 1)) {
+        group = groups + dest_table[slot] - 1;
+        if (group->path_len == hdr->path_len
+            && !memcmp(group->path, path, hdr->path_len)) {
+            break;
+        }
+    }
+    if (!dest_table[slot]) {
+        group = groups + group_count++;
+        group->path = path;
+        group->path_len = hdr->path_len;
+        group->first = line_count;
+        group->count = 0;
+        group->len = 0;
+        group->slot = slot;
+        dest_table[slot] = group_count;
+    } else {
+        line_next[group->last] = line_count;
+    }
+    group->last = line_count;
+    group->count++;
+    group->len += hdr->line_len;
+    line_rec[line_count] = (char*) hdr;
+    line_next[line_count++] = -1;
+}
+
+/*
+ * Queue the writes for the groups collected so far, and start over
+ */
+static void write_groups(void) {
+    dest_group *group;
+    record_hdr *hdr;
+    struct iovec *iov;
+    fd_element *file;
+    int line, n;
+    unsigned len;
+
+    for (group = groups; group < groups + group_count; group++) {
+        dest_table[group->slot] = 0;
+
+        memcpy(path_buf, group->path, group->path_len);
+        path_buf[group->path_len] = '\0';
+        file = get_file(path_buf);
+        if (!file) {
+            log_printf(0, ZONE, "write_log: get_fd(%s): %s, %d lines ignored.",
+                       path_buf, LAST_ERROR, group->count);
+            continue;
+        }
+        LOG_PRINTF(DEBUG_MAX, ZONE, "writing %d lines, %u bytes to %s",
+                   group->count, group->len, path_buf);
+
+        /*
+         * In pieces of at most IOV_MAX lines
+         */
+        for (line = group->first; line >= 0; ) {
+            iov = frame_iov + iov_used;
+            for (n = 0, len = 0; line >= 0 && n < IOV_MAX;
+                 n++, line = line_next[line]) {
+                hdr = (record_hdr*) line_rec[line];
+                iov[n].iov_base = (char*) (hdr + 1) + hdr->path_len;
+                iov[n].iov_len = hdr->line_len;
+                len += hdr->line_len;
+            }
+            iov_used += n;
+            file_writev(file, iov, n, len);
+        }
+    }
+    group_count = 0;
+    line_count = 0;
+}
+
+/*
+ * A REC_CLOSE from one worker. Each worker sends it after its last
+ * line for the old log file name, so once all of them have, no more
+ * lines can come for those files and they are closed and synced. If a
+ * worker died before sending its own, the files are closed at the next
+ * change of the name instead.
  */
-inline void my_pipe_read(int fd, char *buf, int size) {
-    int left = size;
-    int recvd = 0;
-    while (left) {
-        if ((recvd = read(fd, buf + size - left, left)) < 0) {
-            DIE_ERROR(1, ZONE, "read(pipe, %d): %s", size, LAST_ERROR);
-        } else {
-            left -= recvd;
+static void rotate_close(close_rec *rec) {
+    static char closing[32];
+    static unsigned long long closed_by;
+
+    if (strcmp(closing, rec->log_file)) {
+        if (closed_by) {
+            close_fd_all(1, closing);
         }
-        if (left)
-            LOG_PRINTF(DEBUG_MIN, ZONE, "read(pipe, %d): %d left to read.",
-                       size, left);
+        strcpy(closing, rec->log_file);
+        closed_by = 0;
+    }
+    closed_by |= 1ULL << rec->worker;
+    LOG_PRINTF(DEBUG_MED, ZONE, "write_log: worker %d done with %s",
+               rec->worker, closing);
+    if (closed_by == (~0ULL >> (64 - workers))) {
+        close_fd_all(1, closing);
+        closing[0] = '\0';
+        closed_by = 0;
     }
 }
 
+/*
+ * Write the records of one frame to their log files. The writes are
+ * queued and done together at the end (see uring.c); the frame has to
+ * stay around until then. Lines that go to append buffers are written
+ * with the buffer, when it fills up or gets too old.
+ */
+void write_frame(char *frame, int size) {
+    record_hdr *hdr;
+    char *pos, *data;
+
+    for (pos = frame; pos < frame + size; pos += REC_SIZE(hdr)) {
+        hdr = (record_hdr*) pos;
+        data = pos + sizeof(record_hdr);
+
+        switch (hdr->type) {
+
+        case REC_LINE:
+            group_line(hdr);
+            break;
+
+        case REC_CLOSE:
+            /*
+             * The lines before this go to the old files.
+             */
+            write_groups();
+            rotate_close((close_rec*) data);
+            break;
+
+        default:
+            log_printf(0, ZONE, "write_log: unknown record type %d, "
+                       "dropping rest of frame.", hdr->type);
+            size = pos - frame; /* stop here */
+            break;
+        }
+    }
+    write_groups();
+    flush_buffers(write_buffer_age);
+    uring_flush();
+    buffers_written();
+    iov_used = 0;
+}
+
+/*
+ * Nothing came in for a while, write the buffers that are old enough
+ */
+static void write_idle(void) {
+    flush_buffers(write_buffer_age);
+    uring_flush();
+    buffers_written();
+}
+
 /*
  * Main loop for write_log process
  *
- * Sits here reading from pipe and writing to log files.
+ * Sits here reading frames from the socket and writing to log files.
  * What a life...
  *
- * if nodaemon mode is set, then the loop is only executed once to make sure
- * we do not get stuck in pipe read forever
+ * Returns when all the senders have closed the socket.
+ * if nodaemon mode is set, then the loop is only executed once (for the
+ * frame that was just sent) to make sure we do not get stuck in recv
+ * forever
  */
 void write_log_process(int p[2]) {
-    int size, fd;
+    int size;
     static int flag = 1;
     int loop_control = 1;
     static int rootdir = 0;
+    static char *frame = NULL;
 
     if (flag) {
         init_fd_table();
+        init_groups();
+        if (!use_uring || uring_init(URING_ENTRIES)) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "write_log: using write()");
+        }
+        /*
+         * gzip writes through the append buffers, a member is finished
+         * when its buffer is flushed (every frame in nodaemon mode)
+         */
+        if (gzip_level) {
+            fd_gzip_config(gzip_level);
+            if (!write_buffer) {
+                write_buffer = GZIP_BUFFER;
+            }
+            write_buffer_age = detach ? gzip_flush : 0;
+            if (!detach) {
+                fd_buffer_config(write_buffer * 1024, write_buffer_age,
+                                 write_buffer_total * 1048576L);
+            }
+        }
+        /*
+         * In nodaemon mode there is no loop here to flush old buffers
+         */
+        if (!detach && write_buffer && !gzip_level) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "write_log: no append buffers in "
+                       "nodaemon mode");
+        }
+        if (detach && write_buffer) {
+            struct timeval idle;
+
+            fd_buffer_config(write_buffer * 1024, write_buffer_age,
+                             write_buffer_total * 1048576L);
+            idle.tv_sec = write_buffer_age / 2000;
+            idle.tv_usec = (write_buffer_age / 2 % 1000) * 1000 + 1000;
+            if (setsockopt(p[0], SOL_SOCKET, SO_RCVTIMEO, &idle,
+                           sizeof(idle))) {
+                LOG_PRINTF(0, ZONE, "setsockopt(write_log, SO_RCVTIMEO): %s",
+                           LAST_ERROR);
+            }
+        }
+        frame = (char*) malloc(WRITE_LOG_FRAME_SIZE);
+        if (!frame) {
+            DIE_ERROR(6, ZONE, "write_log: could not allocate frame buffer");
+        }
         flag = 0;
     }
 
@@ -252,47 +525,35 @@ void write_log_process(int p[2]) {
     }
 
     /*
-     * (Internal) Format of stuff sent through pipe is:
-     * sizeof(int)    length of next string
-     * (above) bytes  filename
-     * sizeof(int)    length of next string
-     * (above) bytes  log text (w/o newline)
+     * Every recv() returns exactly one frame (SOCK_SEQPACKET), that is
+     * a sequence of records as described in logger.h
      */
     while (loop_control) {
 
-        my_pipe_read(p[0], (char*)&size, sizeof(size));
-        my_pipe_read(p[0], path_buf, size);
-        path_buf[size] = '\0';
-
-        my_pipe_read(p[0], (char*)&size, sizeof(size));
-        my_pipe_read(p[0], msg_buf, size);
-        msg_buf[size] = '\n';
-
-        if (size == sizeof(time_t)) {
-            /*
-             * This was a short message telling to clean up descriptors because
-             * log file name has changed.
-             */
-            close_fd_all(1, *(time_t *) msg_buf);
-        } else {
-
-            fd = get_fd(path_buf);
-            if (fd) {
-                write(fd, msg_buf, size + 1);
-                LOG_PRINTF(DEBUG_MAX, ZONE, "wrote %d bytes to %s",
-                           size + 1, path_buf);
-            } else {
-                log_printf(0, ZONE, "write_log: get_fd(%s): %s, ignored.",
-                           path_buf, LAST_ERROR);
-                /*
-                 * The log line is ignored in this case...
-                 */
+        if ((size = recv(p[0], frame, WRITE_LOG_FRAME_SIZE, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                write_idle();
+                continue;
             }
+            DIE_ERROR(1, ZONE, "recv(write_log): %s", LAST_ERROR);
         }
+        if (!size) {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "write_log: all senders are gone.");
+            flush_buffers(0);
+            uring_flush();
+            buffers_written();
+            uring_stats();
+            fd_cache_stats();
+            return;
+        }
+
+        write_frame(frame, size);
 
         if (!detach) {
             loop_control = 0; /* or just break would be enough. */
         }
     }
 }
-
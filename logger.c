@@ -11,7 +11,24 @@
  * Description:
  * Logger client. Receive log message through pipe and send them as UDP
  * packets to log server. This is a very simple client. All the work is
- * done at the server side.
+ * done at the server side. With --pack, the lines are packed several
+ * to a datagram (see logger.h).
+ *
+ * The client must never hold up Apache, which blocks when the pipe is
+ * full. So the socket is non-blocking: datagrams wait in a bounded queue
+ * until the socket takes them, and when the queue is full the new lines
+ * are dropped (and counted) instead.
+ *
+ * With --compress, every datagram that gets smaller is sent compressed
+ * (see FRAME_LZ4 in logger.h). With --binary the lines are split into
+ * their fields and sent as binary records (see wire.h), which the server
+ * does not have to parse.
+ *
+ * --to unix:PATH sends the datagrams to the Unix socket of a server on
+ * the same host (httpd-logd --unix), tcp:HOST:PORT and unix-stream:PATH
+ * over one stream connection (httpd-logd --stream), with their lengths.
+ * A Unix or stream connection that fails is opened again after
+ * RECONNECT_DELAY; meanwhile the lines wait in the queue.
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -27,74 +44,536 @@
  * Free Software Foundation, Inc.
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
  */
-/*
- *
- * TODO: maybe buffering ?
- */
-
 static const char *VERSION __attribute__ ((used)) = "$Id$";
 
+#define _GNU_SOURCE /* for ppoll() */
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/un.h>
 #include "logger.h"
 #include "debug.h"
+#include "scan.h"
+#include "lz4.h"
+#include "wire.h"
 
 extern char *SIGNAL_NAME(int); /* defined in signalnames.c */
 
 char host[HOSTNAME_SIZE];
-char buffer[MSG_SIZE];
-int sock;
+char buffer[LOGGER_READ + 1];   /* input, read() from the pipe         */
+char packet[PACKET_SIZE];       /* lines waiting to be sent (--pack)   */
+int sock = -1;                  /* connected to the server             */
+struct sockaddr_in logserv;
+struct sockaddr_un logunix;
+struct sockaddr *server;        /* one of the above                    */
+socklen_t server_len;
+int server_type = SOCK_DGRAM;   /* SOCK_STREAM for tcp: and unix-stream: */
+char server_name[HOSTNAME_SIZE + 16]; /* for the messages            */
+struct timespec reconnect_at;   /* CLOCK_MONOTONIC, when sock < 0      */
+int partial = 0;                /* bytes of the first datagram written */
+
+#define RECONNECT_DELAY 1 /* s */
+
+/*
+ * Datagrams waiting to be sent: their bytes are in ring (ring_size) and
+ * they are listed in queue, from queue_head on. A datagram is always in
+ * one piece; if it does not fit before the end of the ring it goes at
+ * the start.
+ */
+typedef struct {
+    int offset;
+    int length;
+    int lines;
+} datagram;
+
+char *ring;
+int ring_size = LOGGER_RING * 1024;
+int ring_tail = 0;              /* where the next datagram goes        */
+datagram queue[SEND_QUEUE];
+int queue_head = 0, queued = 0;
 
 int debug = DEBUG_DEFAULT;
 int detach = 0; /* to keep debug.c happy */
+int pack_size = LOGGER_PACK;    /* bytes per datagram, 0 for no packing */
+int pack_delay = PACK_DELAY;    /* us                                   */
+int pack_len = 0, pack_lines = 0;
+struct timespec pack_deadline;  /* CLOCK_MONOTONIC, send the packet by  */
+long lines = 0;
 long packets = 0;
 long discarded = 0;
+long dropped = 0;               /* lines, queue full or never sent     */
 long failed = 0;
+int compress = 0;               /* --compress                          */
+char *benchmark = NULL;         /* --benchmark file                    */
+unsigned long plain_bytes = 0, sent_bytes = 0;
+int binary = 0;                 /* --binary                            */
+wire_dict dict;                 /* strings of the binary packet        */
+unsigned long text_bytes = 0, record_bytes = 0;
 
 struct option longs[] = {
     {"to",required_argument, NULL, 't'},
     {"port", required_argument, NULL, 'p'},
     {"debug", required_argument, NULL, 'd'},
+    {"pack", required_argument, NULL, 'P'},
+    {"pack-delay", required_argument, NULL, 'W'},
+    {"queue",   required_argument, NULL, 'Q'},
+    {"compress", no_argument, NULL, 'z'},
+    {"benchmark", required_argument, NULL, 'X'},
+    {"binary", no_argument, NULL, 'B'},
     {"unknown", 0, NULL, 0}
 };
 
-const char shorts[] = "t:p:d:m";
+const char shorts[] = "t:p:d:mP:W:Q:zX:B";
 char me[32];
 
+void flush_packet(void);
+void drain_queue(void);
+
 void cleanup(int sig) {
     static int exiting = 0;
     if (exiting++) { /* let's imagine this is atomic... :-) */
         --exiting;
     } else {
+        flush_packet();
+        drain_queue();
         close(sock);
         if (sig) {
             log_printf(0, ZONE, "%s: got signal %d (%s), exiting.", me, sig,
                        SIGNAL_NAME(sig));
-        } else {
-            log_printf(0, ZONE, "%s: pipe closed (EOF), exiting.", me);
+            exit(0); /* the stats are logged by cleanup_atexit() */
         }
-        exit(0);
+        log_printf(0, ZONE, "%s: pipe closed (EOF), exiting.", me);
     }
 }
 
 void cleanup_atexit(void) {
     cleanup(0);
+    if (compress && plain_bytes) {
+        log_printf(0, ZONE, "%s: Stats: %lu bytes compressed to %lu "
+                   "(%.1f%% saved)", me, plain_bytes, sent_bytes,
+                   100.0 - 100.0 * sent_bytes / plain_bytes);
+    }
+    if (binary && text_bytes) {
+        log_printf(0, ZONE, "%s: Stats: %lu bytes of lines sent as %lu "
+                   "bytes of records (%.1f%% saved)", me, text_bytes,
+                   record_bytes, 100.0 - 100.0 * record_bytes / text_bytes);
+    }
     DIE_ERROR(0, ZONE,
-              "%s: Stats: %lu entries sent, %lu discarded, %lu failed xmit", me,
-              packets, discarded, failed);
+              "%s: Stats: %lu entries sent in %lu packets, %lu dropped, "
+              "%lu discarded, %lu failed xmit", me, lines,
+              packets, dropped, discarded, failed);
 }
 
-int main(int argc, char** argv) {
-    struct sockaddr_in logserv;
+/*
+ * Connect to the server (non-blocking). On failure, the next try is
+ * after RECONNECT_DELAY. Returns 0 if connected or connecting.
+ */
+int open_socket(void) {
+    if ((sock = socket(server->sa_family, server_type | SOCK_NONBLOCK,
+                       0)) < 0) {
+        DIE_ERROR(1, ZONE, "%s: socket(): %s", me, LAST_ERROR);
+    }
+    /*
+     * Connected, so that the kernel does not look up the route for every
+     * datagram, and non-blocking
+     */
+    if (connect(sock, server, server_len) && errno != EINPROGRESS) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "%s: connect(%s): %s", me,
+                   server_name, LAST_ERROR);
+        close(sock);
+        sock = -1;
+        clock_gettime(CLOCK_MONOTONIC, &reconnect_at);
+        reconnect_at.tv_sec += RECONNECT_DELAY;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The connection is gone (a stream, or the Unix socket of the server);
+ * a datagram cut in the middle cannot be sent again.
+ */
+void lost_connection(const char *why) {
+    LOG_PRINTF(DEBUG_ERROR, ZONE, "%s: send(%s): %s", me, server_name, why);
+    close(sock);
+    sock = -1;
+    if (partial) {
+        partial = 0;
+        ++failed;
+        queue_head = (queue_head + 1) % SEND_QUEUE;
+        queued--;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &reconnect_at);
+    reconnect_at.tv_sec += RECONNECT_DELAY;
+}
+
+/*
+ * Queue a datagram holding count lines, or drop it if there is no room.
+ * On a stream, it goes with its length in front.
+ */
+void send_datagram(char *data, int length, int count) {
+    static char framed[FRAME_LZ4_HEADER + LZ4_BOUND(PACKET_SIZE)];
+    datagram *last;
+    int offset, head, packed, frame;
+
+    if (compress && length > FRAME_LZ4_HEADER + 1) {
+        plain_bytes += length;
+        packed = lz4_compress(data, length, framed + FRAME_LZ4_HEADER,
+                              length - FRAME_LZ4_HEADER - 1);
+        if (packed > 0) {
+            framed[0] = (char) FRAME_MARK;
+            framed[1] = FRAME_LZ4;
+            framed[2] = length >> 8;
+            framed[3] = length & 0xff;
+            data = framed;
+            length = FRAME_LZ4_HEADER + packed;
+        }
+        sent_bytes += length;
+    }
+    frame = (server_type == SOCK_STREAM) ? STREAM_HEADER : 0;
+    length += frame;
+
+    if (!queued) {
+        ring_tail = 0;
+    }
+    head = queued ? queue[queue_head].offset : 0;
+
+    if (queued == SEND_QUEUE) {
+        offset = -1;
+    } else if (queued && ring_tail <= head) {
+        /* wrapped around, the free space is up to head */
+        offset = (ring_tail + length <= head) ? ring_tail : -1;
+    } else if (ring_tail + length <= ring_size) {
+        offset = ring_tail;
+    } else {
+        offset = (length <= head) ? 0 : -1;
+    }
+    if (offset < 0) {
+        dropped += count;
+        return;
+    }
+
+    if (frame) {
+        ring[offset] = (length - frame) >> 8;
+        ring[offset + 1] = (length - frame) & 0xff;
+    }
+    memcpy(ring + offset + frame, data, length - frame);
+    ring_tail = offset + length;
+    last = queue + (queue_head + queued++) % SEND_QUEUE;
+    last->offset = offset;
+    last->length = length;
+    last->lines = count;
+}
+
+/*
+ * Send the datagrams queued for a stream, with one sendmsg() for up to
+ * SEND_BATCH of them. Returns the number of datagrams written whole, or
+ * -1 on error.
+ */
+static int send_stream(struct iovec *iov, int count) {
+    struct msghdr msg;
+    int i, written;
+
+    iov[0].iov_base = (char*) iov[0].iov_base + partial;
+    iov[0].iov_len -= partial;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    if ((written = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+        return -1;
+    }
+    for (i = 0; i < count && written >= (int) iov[i].iov_len; i++) {
+        written -= iov[i].iov_len;
+        partial = 0;
+    }
+    partial += written; /* of the first one not written whole */
+    return i;
+}
+
+/*
+ * Send the queued datagrams, as many as the socket takes without
+ * blocking. Returns the number left in the queue.
+ */
+int send_queued(void) {
+    struct iovec iov[SEND_BATCH];
+    struct timespec now;
+    datagram *first;
+    int i, count, sent;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[SEND_BATCH];
+#endif
+
+    if (sock < 0 && queued) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < reconnect_at.tv_sec
+            || (now.tv_sec == reconnect_at.tv_sec
+                && now.tv_nsec < reconnect_at.tv_nsec)
+            || open_socket()) {
+            return queued;
+        }
+    }
+    while (queued) {
+        count = (queued < SEND_BATCH) ? queued : SEND_BATCH;
+        for (i = 0; i < count; i++) {
+            first = queue + (queue_head + i) % SEND_QUEUE;
+            iov[i].iov_base = ring + first->offset;
+            iov[i].iov_len = first->length;
+        }
+        if (server_type == SOCK_STREAM) {
+            sent = send_stream(iov, count);
+        } else {
+#ifdef HAVE_SENDMMSG
+            memset(msgs, 0, count * sizeof(struct mmsghdr));
+            for (i = 0; i < count; i++) {
+                msgs[i].msg_hdr.msg_iov = iov + i;
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            sent = sendmmsg(sock, msgs, count, MSG_DONTWAIT);
+#else
+            for (sent = 0; sent < count; sent++) {
+                if (send(sock, iov[sent].iov_base, iov[sent].iov_len,
+                         MSG_DONTWAIT) < 0) {
+                    break;
+                }
+            }
+            if (!sent) {
+                sent = -1;
+            }
+#endif
+        }
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (server->sa_family == AF_UNIX
+                || server_type == SOCK_STREAM) {
+                lost_connection(LAST_ERROR);
+                break;
+            }
+            /*
+             * For instance ECONNREFUSED, when the server is not running.
+             * That datagram is lost.
+             */
+            LOG_PRINTF(DEBUG_ERROR, ZONE, "%s: send(%s): %s", me,
+                       server_name, LAST_ERROR);
+            ++failed;
+            queue_head = (queue_head + 1) % SEND_QUEUE;
+            queued--;
+            continue;
+        }
+        for (i = 0; i < sent; i++) {
+            first = queue + queue_head;
+            ++packets;
+            lines += first->lines;
+            queue_head = (queue_head + 1) % SEND_QUEUE;
+            queued--;
+        }
+        if (sent < count) {
+            break;
+        }
+    }
+    return queued;
+}
+
+/*
+ * Send the lines packed so far. The last '\n' becomes the '\0' that
+ * ends every datagram; a binary packet gets its record count.
+ */
+void flush_packet(void) {
+    if (!pack_len) {
+        return;
+    }
+    if (binary) {
+        packet[2] = pack_lines >> 8;
+        packet[3] = pack_lines;
+    } else {
+        packet[pack_len - 1] = '\0';
+    }
+    send_datagram(packet, pack_len, pack_lines);
+    pack_len = pack_lines = 0;
+}
+
+static int deadline_passed(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > pack_deadline.tv_sec
+        || (now.tv_sec == pack_deadline.tv_sec
+            && now.tv_nsec >= pack_deadline.tv_nsec);
+}
+
+/*
+ * The packet gets its first line: start the clock
+ */
+static void start_packet(void) {
+    clock_gettime(CLOCK_MONOTONIC, &pack_deadline);
+    pack_deadline.tv_nsec += pack_delay * 1000L;
+    pack_deadline.tv_sec += pack_deadline.tv_nsec / 1000000000;
+    pack_deadline.tv_nsec %= 1000000000;
+}
 
-    struct hostent *info;
+/*
+ * Add the record of a line to the binary packet (--binary), which holds
+ * a single one without --pack. Returns 0 if the line cannot be encoded,
+ * even in a packet by itself.
+ */
+static int send_record(const char *line, int length) {
+    int limit = pack_size ? pack_size : PACKET_SIZE;
+    int n;
+
+    for (;;) {
+        if (!pack_len) {
+            start_packet();
+            packet[0] = (char) FRAME_MARK;
+            packet[1] = FRAME_BINARY;
+            pack_len = WIRE_HEADER;
+            dict.count = 0;
+        }
+        n = wire_encode(&dict, line, length, packet + pack_len,
+                        limit - pack_len);
+        if (n >= 0) {
+            break;
+        }
+        if (!pack_lines) {
+            pack_len = 0;
+            return 0;
+        }
+        flush_packet();
+    }
+    pack_len += n;
+    pack_lines++;
+    text_bytes += length + 1;
+    record_bytes += n;
+    if (!pack_size || pack_lines == 0xffff || deadline_passed()) {
+        flush_packet();
+    }
+    return 1;
+}
+
+/*
+ * Send a line (length bytes, without the '\n', which can be
+ * overwritten), by itself or in the packet
+ */
+void send_line(char *line, int length) {
+    if (binary) {
+        if (send_record(line, length)) {
+            return;
+        }
+        /* does not fit, goes as text */
+        flush_packet();
+        line[length] = '\0';
+        send_datagram(line, length + 1, 1);
+        return;
+    }
+    if (!pack_size || length + 1 > pack_size) {
+        flush_packet();
+        line[length] = '\0';
+        send_datagram(line, length + 1, 1);
+        return;
+    }
+    if (pack_len + length + 1 > pack_size) {
+        flush_packet();
+    }
+    if (!pack_len) {
+        start_packet();
+    }
+    memcpy(packet + pack_len, line, length);
+    pack_len += length;
+    packet[pack_len++] = '\n';
+    pack_lines++;
+    if (deadline_passed()) {
+        flush_packet();
+    }
+}
+
+/*
+ * Apache is gone, we can wait a little for the socket now
+ */
+void drain_queue(void) {
+    struct pollfd out;
+    int i;
+
+    out.events = POLLOUT;
+    while (send_queued() && (out.fd = sock) >= 0 && poll(&out, 1, 1000) > 0)
+        ;
+    for (i = 0; i < queued; i++) {
+        dropped += queue[(queue_head + i) % SEND_QUEUE].lines;
+    }
+    queued = 0;
+}
+
+/*
+ * Read (and so clear) an error pending on the socket, like the
+ * ECONNREFUSED left by an earlier datagram, or see why the connection
+ * was hung up. Unix sockets and streams are connected again later.
+ */
+static void socket_error(int hangup) {
+    int error = 0;
+    socklen_t size = sizeof(error);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &size) || !error) {
+        if (hangup) {
+            lost_connection("connection closed");
+        }
+        return;
+    }
+    if (hangup || server->sa_family == AF_UNIX
+        || server_type == SOCK_STREAM) {
+        lost_connection(strerror(error));
+    } else {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "%s: send(%s): %s", me, server_name,
+                   strerror(error));
+    }
+}
+
+/*
+ * Time left until the packet has to be sent or the server connected
+ * again, for ppoll()
+ */
+static struct timespec *time_left(struct timespec *timeout) {
+    struct timespec now, *deadline = NULL;
+
+    if (pack_len) {
+        deadline = &pack_deadline;
+    }
+    if (sock < 0 && queued
+        && (!deadline || reconnect_at.tv_sec < deadline->tv_sec
+            || (reconnect_at.tv_sec == deadline->tv_sec
+                && reconnect_at.tv_nsec < deadline->tv_nsec))) {
+        deadline = &reconnect_at;
+    }
+    if (!deadline) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout->tv_sec = deadline->tv_sec - now.tv_sec;
+    timeout->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (timeout->tv_nsec < 0) {
+        timeout->tv_sec--;
+        timeout->tv_nsec += 1000000000;
+    }
+    if (timeout->tv_sec < 0) {
+        timeout->tv_sec = timeout->tv_nsec = 0;
+    }
+    return timeout;
+}
 
+int main(int argc, char** argv) {
     int port;
     int i;
     int length, option_index;
+    int line, scanned, end, discarding;
+    int newlines[SCAN_LINES], found, newline;
+    struct pollfd fds[2];
+    struct timespec timeout;
 
     snprintf(me, 32, "logger[%d]", getpid());
 #ifdef USE_SYSLOG
@@ -132,27 +611,98 @@ int main(int argc, char** argv) {
         case 'd':
             debug = atoi(optarg);
             break;
+
+        case 'P':
+            pack_size = atoi(optarg);
+            if (pack_size < 0) {
+                pack_size = 0;
+            } else if (pack_size > PACKET_SIZE) {
+                pack_size = PACKET_SIZE;
+            }
+            break;
+
+        case 'W':
+            pack_delay = atoi(optarg);
+            if (pack_delay < 0) {
+                pack_delay = 0;
+            }
+            break;
+
+        case 'Q':
+            ring_size = atoi(optarg) * 1024;
+            break;
+
+        case 'z':
+            compress = 1;
+            break;
+
+        case 'X':
+            benchmark = optarg;
+            break;
+
+        case 'B':
+            binary = 1;
+            break;
         }
     }
 
     if (optind < argc) { /* there's some argv leftovers */
     };
 
-    if (!(info = gethostbyname(host))) {
-        DIE_ERROR(1, ZONE, "%s: gethostbyname(%s): %s", me, host, LAST_ERROR);
+    if (benchmark) {
+        lz4_benchmark(benchmark, pack_size, FRAME_LZ4_HEADER);
+        exit(0);
     }
 
-    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        DIE_ERROR(1, ZONE, "%s: socket(SOCK_DGRAM): %s", me, LAST_ERROR);
-    }
+    if (!strncmp(host, "unix:", 5) || !strncmp(host, "unix-stream:", 12)) {
+        if (host[4] == '-') {
+            server_type = SOCK_STREAM;
+        }
+        bzero((char*) &logunix, sizeof(logunix));
+        logunix.sun_family = AF_UNIX;
+        strncpy(logunix.sun_path, strchr(host, ':') + 1,
+                sizeof(logunix.sun_path) - 1);
+        server = (struct sockaddr*) &logunix;
+        server_len = sizeof(logunix);
+        snprintf(server_name, sizeof(server_name), "%s", logunix.sun_path);
+    } else {
+        char *name = host, *colon;
+        struct hostent *info;
 
-    bzero((char*) &logserv, sizeof(logserv));
-    logserv.sin_family = AF_INET;
-    logserv.sin_port = htons(port);
-    logserv.sin_addr = *((struct in_addr*) info->h_addr);
+        if (!strncmp(host, "tcp:", 4)) {
+            server_type = SOCK_STREAM;
+            name += 4;
+            if ((colon = strrchr(name, ':'))) {
+                *colon = '\0';
+                if (atoi(colon + 1)) {
+                    port = atoi(colon + 1);
+                }
+            }
+        }
+        if (!(info = gethostbyname(name))) {
+            DIE_ERROR(1, ZONE, "%s: gethostbyname(%s): %s", me, name,
+                      LAST_ERROR);
+        }
+        bzero((char*) &logserv, sizeof(logserv));
+        logserv.sin_family = AF_INET;
+        logserv.sin_port = htons(port);
+        logserv.sin_addr = *((struct in_addr*) info->h_addr);
+        server = (struct sockaddr*) &logserv;
+        server_len = sizeof(logserv);
+        snprintf(server_name, sizeof(server_name), "%s:%d", info->h_name,
+                 port);
+    }
+    LOG_PRINTF(DEBUG_MIN, ZONE, "%s: Using server %s (%s).", me, server_name,
+               (server_type == SOCK_STREAM) ? "stream" : "datagrams");
+    open_socket();
 
-    LOG_PRINTF(DEBUG_MIN, ZONE, "%s: Using server %s [%s] on port %d.", me,
-               info->h_name, inet_ntoa(logserv.sin_addr), ntohs(logserv.sin_port));
+    if (ring_size < PACKET_SIZE) {
+        ring_size = PACKET_SIZE;
+    }
+    if (!(ring = (char*) malloc(ring_size))) {
+        DIE_ERROR(1, ZONE, "%s: could not allocate %d byte queue", me,
+                  ring_size);
+    }
     /* LOG_PRINTF( DEBUG_MED, ZONE, "%s: Reading from stdin...", me ); */
 
     /*
@@ -165,35 +715,90 @@ int main(int argc, char** argv) {
         signal(i, cleanup);
     }
 
-    while (fgets(buffer, MSG_SIZE, stdin)) {
-        length = strlen(buffer);
-        if (length >= MSG_SIZE - 1 && buffer[length] != '\n') {
+    /*
+     * The lines are read with read() rather than stdio, so that we can
+     * wait for input, for the socket and for the packet deadline at the
+     * same time. buffer holds the text read, up to end; the current line
+     * starts at line and has been looked at up to scanned, so every byte
+     * is scanned once. The lines are sent from where they are in buffer.
+     */
+    fds[0].fd = 0;
+    fds[0].events = POLLIN;
+    line = scanned = end = discarding = 0;
+    for (;;) {
+        found = scan_sep(buffer + scanned, end - scanned, '\n', newlines,
+                         SCAN_LINES);
+        for (i = 0; i < found; i++) {
+            newline = scanned + newlines[i];
+            length = newline - line;
+            if (discarding || length >= MSG_SIZE - 1) {
+                LOG_PRINTF(DEBUG_MED, ZONE,
+                           "%s: Discarded %d bytes (exceeded input buffer)",
+                           me, discarding + length + 1);
+                discarding = 0;
+                ++discarded;
+            } else {
+                send_line(buffer + line, length);
+            }
+            line = newline + 1;
+        }
+        if (found == SCAN_LINES) {
+            scanned = line;
+            continue;
+        }
+        scanned = end;
+        /*
+         * Keep the start of the next line
+         */
+        if (line) {
+            memmove(buffer, buffer + line, end - line);
+            end = scanned = end - line;
+            line = 0;
+        }
+        if (discarding || end >= MSG_SIZE - 1) {
             /*
              * The text sent is longer than our buffer, what to do ?
              * For now, eat the rest of the line.
              */
-            while (strlen(buffer) >= MSG_SIZE - 1
-                   && buffer[MSG_SIZE - 1] != '\n'
-                   && fgets(buffer, MSG_SIZE, stdin)) {
-                length += strlen(buffer);
-            }
-            LOG_PRINTF(DEBUG_MED, ZONE,
-                       "%s: Discarded %d bytes (exceeded input buffer)", me,
-                       length);
-            length = 0;
-            ++discarded;
-        }
-        if (length) {
-            buffer[length - 1] = '\0'; /* remove the final '\n' */
-            if (sendto(sock, buffer, length, 0, (struct sockaddr*) &logserv,
-                       sizeof(logserv)) < 0) {
-                LOG_PRINTF(DEBUG_ERROR, ZONE, "%s: sendto( %s:%d ): %s", me,
-                           info->h_name, ntohs(logserv.sin_port), LAST_ERROR);
-                ++failed;
-            } else {
-                ++packets;
+            discarding += end;
+            end = scanned = 0;
+        }
+        fds[1].events = send_queued() ? POLLOUT : 0;
+        fds[1].fd = sock; /* ignored while not connected (-1) */
+        if (!(i = ppoll(fds, 2, time_left(&timeout), NULL))) {
+            flush_packet(); /* deadline */
+            continue;
+        }
+        if (i < 0) {
+            continue;
+        }
+        if (fds[1].revents & (POLLERR | POLLHUP)) {
+            socket_error(fds[1].revents & POLLHUP);
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        if ((length = read(0, buffer + end, LOGGER_READ - end)) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            LOG_PRINTF(DEBUG_ERROR, ZONE, "%s: read(stdin): %s", me,
+                       LAST_ERROR);
+            break;
         }
+        if (!length) {
+            break;
+        }
+        end += length;
     }
+    /*
+     * A last line without '\n'
+     */
+    if (end && !discarding) {
+        send_line(buffer, end);
+    }
+    flush_packet();
+    drain_queue();
+
     return 0; /* keep gcc happy */
 }
@@ -61,45 +61,125 @@
 #define PATH_SIZE 128
 
 /*
- * Number of entries in the log spool area. The bigger the better
- * (depending on machine, after a certain number there is no improvement).
- * After this many entries are filled (or LOG_TIMEOUT occurrs) the
- * server spawns a child to dump the log entries in the right places.
+ * Packed datagrams. The client can send several lines in one datagram,
+ * separated by '\n' (httpd-logger --pack), up to PACKET_SIZE bytes (a
+ * 9000 byte jumbo frame). A datagram with a single line is the same as
+ * an unpacked one. PACK_DELAY is how long (us) the client holds a line
+ * waiting for more to fill the packet.
+ */
+#define PACKET_SIZE 8972
+#ifndef LOGGER_PACK
+#define LOGGER_PACK 0 /* off, one line per datagram */
+#endif
+#ifndef PACK_DELAY
+#define PACK_DELAY 5000
+#endif
+/*
+ * Framed datagrams. A datagram that starts with FRAME_MARK (which no log
+ * line does) is not text, the next byte says what follows. FRAME_LZ4 is
+ * followed by the original length (2 bytes, network order) and the
+ * datagram compressed with lz4.c (httpd-logger --compress). FRAME_BINARY
+ * is a datagram of binary records (httpd-logger --binary, see wire.h),
+ * which may be compressed in turn.
+ */
+#define FRAME_MARK 0xff
+#define FRAME_LZ4 'Z'
+#define FRAME_LZ4_HEADER 4
+#define FRAME_BINARY 'B'
+
+/*
+ * Stream transport (httpd-logd --stream, httpd-logger --to tcp:...):
+ * the same datagrams, each after its length (STREAM_HEADER bytes,
+ * network order). The server reads each connection into a buffer of
+ * STREAM_BUFFER bytes.
+ */
+#define STREAM_HEADER 2
+#ifndef STREAM_BUFFER
+#define STREAM_BUFFER 65536
+#endif
+
+/*
+ * Send queue of the client: LOGGER_RING KB for at most SEND_QUEUE
+ * datagrams (httpd-logger --queue), sent up to SEND_BATCH at a time
+ */
+#ifndef LOGGER_RING
+#define LOGGER_RING 1024
+#endif
+#define SEND_QUEUE 4096
+#define SEND_BATCH 64
+/*
+ * The client reads the pipe LOGGER_READ bytes at a time and looks for the
+ * ends of up to SCAN_LINES lines with one scan_sep() call
+ */
+#ifndef LOGGER_READ
+#define LOGGER_READ 65536
+#endif
+#define SCAN_LINES 256
+
+/*
+ * Maximum number of entries in a batch. The batch size actually used is
+ * adjusted at run time between BATCH_MIN and LOG_ENTRIES from the arrival
+ * rate, so that a batch fills up in about the flush latency target.
+ * Full batches (or the flush timer) hand the batch to the formatter
+ * threads (see pipeline.h).
  */
 #ifndef LOG_ENTRIES
-#define LOG_ENTRIES 128
+#define LOG_ENTRIES 1024
+#endif
+#ifndef BATCH_MIN
+#define BATCH_MIN 16
 #endif
 /*
- * if no packets are received for LOG_TIMEOUT seconds, flush the log buffer.
+ * Flush the log buffer at most FLUSH_LATENCY milliseconds after its first
+ * entry was received, even if it is not full (--max-flush-latency-ms).
  */
-#define LOG_TIMEOUT 4
+#ifndef FLUSH_LATENCY
+#define FLUSH_LATENCY 1000
+#endif
 #define LOG_FIELD_SEPARATOR '\t' /* in apache log line */
 /*
- * maximum number of simmultaneous live children allowed
- * (after this value is reached the server refuses new data
+ * maximum number of datagrams drained from the socket with a single
+ * recvmmsg() call (can be lowered with --recv-batch)
+ */
+#ifndef RECV_BATCH
+#define RECV_BATCH 32
+#endif
+/*
+ * maximum number of receive workers (--workers), each with its own
+ * SO_REUSEPORT socket and process
  */
-#ifndef MAX_LIVE_CHILDREN
-#define MAX_LIVE_CHILDREN 10
+#ifndef MAX_WORKERS
+#define MAX_WORKERS 64
 #endif
 /*
- * delay time limit (when fork() fails a delay is inserted, which
- * starts at 1s and is doubled for every failure). This limits the
- * maximum wait time (in seconds).
+ * maximum number of request headers (%{...}i) besides Referer and
+ * User-agent in the input format
  */
-#ifndef MAX_FAILEDFORK_DELAY
-#define MAX_FAILEDFORK_DELAY 64
+#ifndef MAX_HEADERS
+#define MAX_HEADERS 8
 #endif
+/*
+ * virtual hosts remembered by each formatter thread (see log_entry.c),
+ * and the size of their hash table
+ */
+#ifndef VHOST_MAX
+#define VHOST_MAX 65536
+#endif
+#define VHOST_HASH_SIZE 16384
 /*
  * Log entry structure. All the char* fields are supposed to point
  * to somewhere inside the logline buffer, so that we don't need to
- * worry about fragmentation
+ * worry about fragmentation. The datagram is received directly into
+ * logline and split in place (see format.c). Fields that are not in the
+ * input format are NULL, or -1 for the numbers (reset for every line by
+ * input_parse() and input_decode()); the output prints them as "-".
  */
 typedef struct {
     time_t time;        /* timestamp of request                */
     char *hostip;       /* source IP of request (%a)           */
     char *remote_user;  /* identd remote user   (%l)           */
     char *user;         /* authenticated user   (%u)           */
-    unsigned status;    /* status of request    (%s)           */
+    unsigned status;    /* status of request (%s), 0 if unparsed */
     unsigned bytes;     /* bytes sent in reply  (%b)           */
     char *vhost;        /* virtual host name    (%v)           */
     char *user_agent;
@@ -107,11 +187,45 @@ typedef struct {
     char *method;       /* GET POST or whatever                */
     char *uri;          /* URI of request                      */
     char *proto;        /* protocol of request (HTTP/1.1,etc)  */
+    unsigned duration;  /* time to serve the request, us (%D)  */
+    char *headers[MAX_HEADERS]; /* other headers, in input order */
     char logline[MSG_SIZE+1];    /* original log line        */
 } log_entry;
 
 #define LOGGER_SPOOL    "/var/log/httpd-log"
 
+/*
+ * Messages for the write_log process. They are sent as frames over a
+ * SOCK_SEQPACKET socket pair, so one send() carries a whole batch (or
+ * WRITE_LOG_FRAME_SIZE worth of it) and one recv() gets it back.
+ * A frame is a sequence of records, each made of a header followed by
+ * path_len + line_len bytes and padded to a multiple of 8 bytes:
+ *   REC_LINE   path of the log file, log line (with newline)
+ *   REC_CLOSE  no path, a close_rec: the worker is done with that log
+ *              file name. write_log closes (and syncs) the files once
+ *              every worker has sent one, see write_frame()
+ */
+#define WRITE_LOG_FRAME_SIZE 65536
+
+#define REC_LINE  1
+#define REC_CLOSE 2
+
+typedef struct {
+    unsigned short type;
+    unsigned short path_len;
+    unsigned line_len;
+} record_hdr;
+
+typedef struct {
+    int worker;                 /* id of the worker that switched  */
+    char log_file[32];          /* the log file name it stopped using */
+} close_rec;
+
+#define REC_SIZE(hdr) \
+    ((sizeof(record_hdr) + (hdr)->path_len + (hdr)->line_len + 7) & ~7)
+/* maximum size of one record */
+#define WRITE_LOG_REC_SIZE (sizeof(record_hdr) + PATH_SIZE + MSG_SIZE + 8)
+
 /* log file naming, in strftime(3) format TODO: this should be an option */
 #define LOG_FILE_FORMAT "%Y-%m-%d.log" /* daily log */
 /* #define LOG_FILE_FORMAT "%Y-%m.log" *//* monthly log */
@@ -134,8 +248,9 @@ typedef struct {
  */
 void get_hash(char hashed[PATH_SIZE], char *name);
 int make_hash(char hashed[PATH_SIZE], char *name);
-void process_entry(log_entry *rec);
+void mk_timestamp(time_t t, char *where);
+int format_entry(log_entry *rec, const char *log_file, char *out);
 
-void write_log_process(int p[2]); /* argument is pipe */
+void write_log_process(int p[2]); /* argument is socket pair */
 
 #endif
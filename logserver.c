@@ -9,7 +9,9 @@
  * $Revision$
  *
  * Description:
- * Logger daemon. Receives log lines on predefined UDP port and processes them
+ * Logger daemon. Receives log lines on predefined UDP port and processes them.
+ * Local clients can also use a Unix datagram socket (--unix), and clients
+ * that send a lot a single stream connection, Unix or TCP (--stream).
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -28,6 +30,7 @@
 
 static const char *VERSION __attribute__ ((used)) = "$Id$";
 
+#define _GNU_SOURCE /* for recvmmsg() */
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -36,34 +39,103 @@ static const char *VERSION __attribute__ ((used)) = "$Id$";
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "logger.h"
+#include "pipeline.h"
+#include "scan.h"
+#include "format.h"
+#include "uring.h"
 #include "fd_cache.h"
+#include "lz4.h"
 #include "debug.h"
 
 char host[HOSTNAME_SIZE + 1];
-char buffer[MSG_SIZE + 1];
-int sock; /* file descriptor id for our socket */
 int port; /* port where we listen to           */
 
 char *logger_spool = LOGGER_SPOOL;
 
-int timer_expired = 0;
 int day = 0;
 time_t time_limit = 0;
 extern char log_file[]; /* defined in log_entry.c */
 extern char *SIGNAL_NAME(int); /* defined in signalnames.c */
 
-int write_log[2]; /* pipe for communication with write_log process */
+int write_log[2]; /* socket pair for communication with write_log process */
 int write_log_pid = 0;
 
 int debug = DEBUG_DEFAULT;
 int detach = DEFAULT_DETACH;
 
 int action = 0; /* this will hold the name of the signal caught */
-int packets_received = 0;
+
+/*
+ * Batched receive. recv_batch is the maximum number of datagrams drained
+ * from the socket per wakeup (1 disables recvmmsg()).
+ */
+int recv_batch = RECV_BATCH;
+
+/*
+ * Receive state of one worker. With --workers N there are N worker
+ * processes, each with its own SO_REUSEPORT socket, batch and stats;
+ * by default the main process is the only worker.
+ * The histogram counts how many datagrams each recvmmsg() call returned.
+ * Datagrams are received straight into the free entries of the batch;
+ * what does not fit in the entry (of a packed datagram) goes to the
+ * overflow of its slot.
+ */
+typedef struct {
+    int id;
+    int sock;                   /* file descriptor id for our socket */
+    batch_t *batch;             /* batch being filled                */
+    int batch_size;             /* current target size of the batch  */
+    double arrival_rate;        /* entries/s, moving average         */
+    int packets_received;
+    unsigned long lines_received;
+    unsigned long framed, framed_bytes, expanded_bytes, bad_frames;
+    unsigned long connections, stream_frames;
+    unsigned long binary, bad_records;
+    unsigned long recv_batches;
+    unsigned long recv_histogram[RECV_BATCH + 1];
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr recv_msgs[RECV_BATCH];
+    struct sockaddr_in recv_addr[RECV_BATCH];
+#endif
+    struct iovec recv_iov[RECV_BATCH][2];
+    int recv_len[RECV_BATCH];
+    char recv_overflow[RECV_BATCH][PACKET_SIZE - MSG_SIZE];
+    /* datagrams whose lines go to the next batch */
+    char carry[RECV_BATCH * PACKET_SIZE];
+    int carry_len[RECV_BATCH];
+} worker_t;
+
+worker_t *self = NULL;  /* the worker running in this process */
+
+int workers = 1;
+int formatters = FORMAT_THREADS; /* threads per worker */
+int queue_depth = PIPELINE_DEPTH; /* batches per worker */
+int pipeline_memory = PIPELINE_MEMORY; /* MB per worker */
+int max_flush_latency = FLUSH_LATENCY; /* ms, target for the batch size */
+char *input_format = INPUT_FORMAT;
+int use_uring = 1;      /* write_log writes with io_uring if available */
+int write_buffer = 0;   /* KB per log file, 0 for no append buffers  */
+int write_buffer_age = WRITE_BUFFER_AGE;     /* ms */
+int write_buffer_total = WRITE_BUFFER_TOTAL; /* MB */
+int gzip_level = 0;     /* --gzip, 0 for plain log files           */
+int gzip_flush = GZIP_FLUSH;                 /* ms, per gzip member */
+char *output_format = OUTPUT_FORMAT;
+char *unix_path = NULL; /* --unix, Unix datagram socket        */
+char *stream_spec = NULL; /* --stream, unix:PATH or tcp:[HOST:]PORT */
+int unix_sock = -1, stream_sock = -1; /* both served by worker 0 */
+int *worker_socks;      /* (supervisor) socket of each worker   */
+pid_t *worker_pids;     /* (supervisor) process id of each worker */
 
 struct option longs[] = {
     {"listen",  required_argument, NULL, 'l'},
@@ -72,141 +144,234 @@ struct option longs[] = {
     {"nodaemon",      no_argument, NULL, 'n'},
     {"daemon",        no_argument, NULL, 'D'},
     {"spool",   required_argument, NULL, 's'},
+    {"recv-batch", required_argument, NULL, 'b'},
+    {"workers", required_argument, NULL, 'w'},
+    {"formatters", required_argument, NULL, 'f'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"pipeline-memory", required_argument, NULL, 'm'},
+    {"max-flush-latency-ms", required_argument, NULL, 'L'},
+    {"format",  required_argument, NULL, 'F'},
+    {"input-format", required_argument, NULL, 'I'},
+    {"no-uring",      no_argument, NULL, 'U'},
+    {"write-buffer", required_argument, NULL, 'B'},
+    {"write-buffer-age", required_argument, NULL, 'A'},
+    {"write-buffer-total", required_argument, NULL, 'M'},
+    {"benchmark", required_argument, NULL, 'X'},
+    {"unix",    required_argument, NULL, 'u'},
+    {"stream",  required_argument, NULL, 'S'},
+    {"gzip",    required_argument, NULL, 'z'},
+    {"gzip-flush", required_argument, NULL, 'Z'},
     {"unknown", 0, NULL, 0}
 };
 
-const char shorts[] = "l:p:d:nDs:";
+const char shorts[] = "l:p:d:nDs:b:w:f:q:m:L:F:I:UB:A:M:X:u:S:z:Z:";
+
 
-log_entry log_buffer[LOG_ENTRIES];
-int log_counter = 0;
+void update_log_file(void); /* defined later in this file */
+void process_batch(void);
+pid_t spawn_write_log(void);
 
-int child_counter = 0;
 /*
- * message structure passed to write_log when log file name is changed
- * 2 x ( length, msg )
+ * Event core. Everything the main loop waits for is an epoll event:
+ * the receive sockets and stream connections, the batch flush timer,
+ * the log rotation deadline and the signals (delivered through a
+ * signalfd, SIGCHLD included).
+ * Nothing is polled, so an idle server does not wake up at all.
  */
-char write_log_msg[2* (sizeof (unsigned)+sizeof(time_t))];
-char *write_log_tmp; /* helper pointer for above */
-time_t logfd_age = 0;
+int epoll_fd = -1;
+int signal_fd = -1;
+int flush_timer = -1;  /* CLOCK_MONOTONIC, armed while a batch is pending */
+int rotate_timer = -1; /* CLOCK_REALTIME, absolute time_limit              */
+int flush_armed = 0;
+sigset_t orig_sigmask; /* restored in children                            */
 
-void update_log_file(void); /* defined later in this file */
-pid_t spawn_write_log(void);
+#define MAX_EVENTS 8
+int ready[MAX_EVENTS]; /* the sockets with input, from wait_loop()        */
+int ready_count = 0;
 
 /*
- * Loop that waits for something to come up, and checks for signals
- * in the meanwhile
+ * Register fd with epoll for input
  */
-#define MSG_IN_QUEUE 1
-#define SIGNAL_CAUGHT 2
-int wait_loop(int sock) {
-    static fd_set read_fds;
-    static int status, child_pid;
-    struct timeval timeout;
-    int nfds = 0;
+void add_event(int fd) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        DIE_ERROR(3, ZONE, "epoll_ctl(ADD, %d): %s", fd, LAST_ERROR);
+    }
+}
 
-    FD_ZERO(&read_fds);
+/*
+ * Set up the epoll instance, the timers and the signalfd.
+ * The signals we handle are blocked so they are only seen through signal_fd.
+ * The supervisor has no socket (sock < 0).
+ */
+void init_events(int sock) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &orig_sigmask)) {
+        DIE_ERROR(3, ZONE, "sigprocmask(): %s", LAST_ERROR);
+    }
 
-    while (!nfds) {
-        FD_SET(sock, &read_fds);
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        DIE_ERROR(3, ZONE, "epoll_create1(): %s", LAST_ERROR);
+    }
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0) {
+        DIE_ERROR(3, ZONE, "signalfd(): %s", LAST_ERROR);
+    }
+    if ((flush_timer = timerfd_create(CLOCK_MONOTONIC,
+                                      TFD_NONBLOCK|TFD_CLOEXEC)) < 0
+        || (rotate_timer = timerfd_create(CLOCK_REALTIME,
+                                          TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+        DIE_ERROR(3, ZONE, "timerfd_create(): %s", LAST_ERROR);
+    }
 
-        /* we only use the timeout to clean up the children */
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 250000;
+    if (sock >= 0) {
+        add_event(sock);
+    }
+    add_event(signal_fd);
+    add_event(flush_timer);
+    add_event(rotate_timer);
+}
 
-        /*
-         * Clean up the dead children
-         */
-        if (child_counter && (child_pid = waitpid(0, &status, WNOHANG))) {
-            child_counter--;
-            if (WIFEXITED(status)) {
-                LOG_PRINTF(DEBUG_MED, ZONE,
-                           "wait_loop: child %d exited with status %d",
-                           child_pid, WEXITSTATUS(status));
-            } else {
-                LOG_PRINTF(DEBUG_MIN, ZONE, "wait_loop: child %d %s.",
-                           child_pid,
-                           WIFSIGNALED(status) ? "was killed" : "died prematurely");
-            }
-            if (child_pid == write_log_pid) { /* oops, __it happens */
-                child_counter++; /* it wasn't the one we expected */
-                LOG_PRINTF(DEBUG_ERROR, ZONE,
-                           "WARNING: write_log (PID %d) died, trying to respawn",
-                           write_log_pid);
-                spawn_write_log();
-            }
+/*
+ * Called in forked children, which do not take part in the event loop.
+ * Gives them back the normal signal mask so that they can be killed.
+ */
+void child_events(void) {
+    close(epoll_fd);
+    close(signal_fd);
+    close(flush_timer);
+    close(rotate_timer);
+    sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+}
+
+/*
+ * Arm (ms > 0) or disarm (ms == 0) the batch flush timer
+ */
+void set_flush_timer(int ms) {
+    struct itimerspec its;
+
+    bzero(&its, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timerfd_settime(flush_timer, 0, &its, NULL)) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "timerfd_settime(flush): %s", LAST_ERROR);
+    }
+    flush_armed = (ms > 0);
+}
+
+/*
+ * Arm the rotation timer for the (absolute) time when the log file
+ * name has to change. It is cancelled if the clock is set, so we get
+ * to recompute the deadline.
+ */
+void set_rotate_timer(time_t when) {
+    struct itimerspec its;
+
+    bzero(&its, sizeof(its));
+    its.it_value.tv_sec = when;
+    if (timerfd_settime(rotate_timer, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET,
+                        &its, NULL)) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "timerfd_settime(rotate): %s", LAST_ERROR);
+    }
+}
+
+/*
+ * Clean up the dead children (on SIGCHLD). The only one we expect to die
+ * is write_log.
+ */
+void reap_children(void) {
+    int status;
+    pid_t child_pid;
+
+    while ((child_pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (WIFEXITED(status)) {
+            LOG_PRINTF(DEBUG_MED, ZONE,
+                       "reap_children: child %d exited with status %d",
+                       child_pid, WEXITSTATUS(status));
+        } else {
+            LOG_PRINTF(DEBUG_MIN, ZONE, "reap_children: child %d %s.",
+                       child_pid,
+                       WIFSIGNALED(status) ? "was killed" : "died prematurely");
+        }
+        if (child_pid == write_log_pid) { /* oops, __it happens */
+            LOG_PRINTF(DEBUG_ERROR, ZONE,
+                       "WARNING: write_log (PID %d) died, trying to respawn",
+                       write_log_pid);
+            spawn_write_log();
         }
+    }
+}
 
-        /*
-         * Check the log file name (maybe it needs to be changed)
-         */
-        update_log_file();
+/*
+ * Loop that waits for something to come up. Timers and dead children
+ * are handled here; returns when sockets have data (listed in ready)
+ * or a signal that needs the attention of the main loop was caught
+ * (in action).
+ */
+#define MSG_IN_QUEUE 1
+#define SIGNAL_CAUGHT 2
+int wait_loop(void) {
+    struct epoll_event events[MAX_EVENTS];
+    struct signalfd_siginfo info;
+    uint64_t expired;
+    int nfds, i, result;
 
-        /*
-         * See if we changed the log file, and if so, signal write_log to clean
-         * up its descriptor table. We only do that after all children have died
-         * (since I cannot differentiate the old ones from the new ones)
-         */
-        if (logfd_age && !child_counter) {
-            /*
-             * This part would look nicer if structs were guaranteed
-             * to preserve the order of their fields.
-             */
-            write_log_tmp = write_log_msg;
-#define WRITE_LOG_ADD(type, value) \
-      *(type*)write_log_tmp = value; \
-      write_log_tmp += sizeof(type);
-
-            WRITE_LOG_ADD(unsigned, sizeof(time_t));
-            WRITE_LOG_ADD(time_t, 0);
-            WRITE_LOG_ADD(unsigned, sizeof(time_t));
-            WRITE_LOG_ADD(time_t, logfd_age);
-#undef WRITE_LOG_ADD
-
-            write(write_log[1], &write_log_msg, write_log_tmp - write_log_msg);
-            logfd_age = 0;
-
-            if (!detach) {
-                LOG_PRINTF(DEBUG_MED, ZONE,
-                           "calling write_log_process() to close fds");
-                write_log_process(write_log);
+    while (1) {
+        if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno != EINTR) {
+                LOG_PRINTF(0, ZONE, "main epoll_wait() failed: %s", LAST_ERROR);
             }
+            continue;
         }
 
-        /*
-         * Safety to prevent forking too many children at the same time.
-         * We refuse receiving data if we have this many children still alive
-         */
-        if (child_counter > MAX_LIVE_CHILDREN) {
-            LOG_PRINTF(DEBUG_MIN, ZONE,
-                       "wait_loop: stopped receiving data, too many children (%d)",
-                       child_counter);
-            nfds = 0;
-        } else {
-            nfds = select(FD_SETSIZE, (fd_set *) &read_fds, (fd_set *) NULL,
-                          (fd_set *) NULL, &timeout);
-        }
-        if (nfds < 0) {
-            if (errno == EINTR) {
-                return SIGNAL_CAUGHT;
+        result = 0;
+        ready_count = 0;
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.fd == flush_timer) {
+                read(flush_timer, &expired, sizeof(expired));
+                flush_armed = 0;
+                LOG_PRINTF(DEBUG_MAX, ZONE, "wait_loop: flush timeout");
+                process_batch();
+
+            } else if (events[i].data.fd == rotate_timer) {
+                /* fails with ECANCELED if the clock was set, same thing */
+                read(rotate_timer, &expired, sizeof(expired));
+                update_log_file();
+
+            } else if (events[i].data.fd == signal_fd) {
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGCHLD) {
+                        reap_children();
+                    } else {
+                        action = info.ssi_signo;
+                    }
+                }
+
             } else {
-                LOG_PRINTF(0, ZONE, "main select() failed: %s", LAST_ERROR);
+                ready[ready_count++] = events[i].data.fd;
+                result = MSG_IN_QUEUE;
             }
         }
+        /*
+         * Signals first; the socket stays readable and is picked up next time.
+         */
         if (action) {
             return SIGNAL_CAUGHT;
         }
+        if (result) {
+            return result;
+        }
     }
-    packets_received++;
-    return MSG_IN_QUEUE;
-}
-
-/*
- * Generic signal handler
- * We don't restore the handler to prevent a race (?)
- */
-void signal_catch(int something) {
-    action = something;
-    /* signal( something, signal_catch ); */
 }
 
 /*
@@ -256,6 +421,121 @@ void command_line(int argc, char **argv) {
         case 's':
             logger_spool = strdup(optarg);
             break;
+
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1) {
+                workers = 1;
+            } else if (workers > MAX_WORKERS) {
+                workers = MAX_WORKERS;
+            }
+            break;
+
+        case 'f':
+            formatters = atoi(optarg);
+            if (formatters < 1) {
+                formatters = 1;
+            }
+            break;
+
+        case 'q':
+            queue_depth = atoi(optarg);
+            if (queue_depth < 2) {
+                queue_depth = 2;
+            }
+            break;
+
+        case 'm':
+            pipeline_memory = atoi(optarg);
+            if (pipeline_memory < 1) {
+                pipeline_memory = 1;
+            }
+            break;
+
+        case 'F':
+            output_format = strdup(optarg);
+            break;
+
+        case 'I':
+            input_format = strdup(optarg);
+            break;
+
+        case 'U':
+            use_uring = 0;
+            break;
+
+        case 'B':
+            write_buffer = atoi(optarg);
+            if (write_buffer < 0) {
+                write_buffer = 0;
+            }
+            break;
+
+        case 'A':
+            write_buffer_age = atoi(optarg);
+            if (write_buffer_age < 1) {
+                write_buffer_age = 1;
+            }
+            break;
+
+        case 'M':
+            write_buffer_total = atoi(optarg);
+            if (write_buffer_total < 1) {
+                write_buffer_total = 1;
+            }
+            break;
+
+        case 'z':
+            gzip_level = atoi(optarg);
+            if (gzip_level < 1) {
+                gzip_level = 1;
+            } else if (gzip_level > 9) {
+                gzip_level = 9;
+            }
+#ifndef HAVE_LIBZ
+            DIE_ERROR(4, ZONE, "--gzip: compiled without zlib");
+#endif
+            break;
+
+        case 'Z':
+            gzip_flush = atoi(optarg);
+            if (gzip_flush < 1) {
+                gzip_flush = 1;
+            }
+            break;
+
+        case 'L':
+            max_flush_latency = atoi(optarg);
+            if (max_flush_latency < 1) {
+                max_flush_latency = 1;
+            }
+            break;
+
+        case 'b':
+            recv_batch = atoi(optarg);
+            if (recv_batch < 1) {
+                recv_batch = 1;
+            } else if (recv_batch > RECV_BATCH) {
+                recv_batch = RECV_BATCH;
+            }
+            break;
+
+        case 'u':
+            unix_path = strdup(optarg);
+            break;
+
+        case 'S':
+            stream_spec = strdup(optarg);
+            break;
+
+        case 'X':
+            /*
+             * The clients may or may not pack lines, so try the usual sizes
+             */
+            lz4_benchmark(optarg, 0, FRAME_LZ4_HEADER);
+            lz4_benchmark(optarg, 1400, FRAME_LZ4_HEADER);
+            lz4_benchmark(optarg, PACKET_SIZE, FRAME_LZ4_HEADER);
+            exit(0);
         }
     }
 
@@ -264,31 +544,50 @@ void command_line(int argc, char **argv) {
 }
 
 /*
- * Generate log file name for this month. Set time value for next day.
- * This is supposed to be called every so often, or (preferrably) set
- * an alarm to wake up when the new time_limit is reached.
+ * Generate log file name for this month. Set time value for next day
+ * and arm rotate_timer to wake us up when the new time_limit is reached.
+ * Tells write_log to close the descriptors of the old files once the
+ * batches queued before the change are written.
  *
- * This is supposed to be called once for init and then at the parent
- * end of process_batch, but it only gets executed if conditions are
- * met anyways so you can call it more often.
+ * This is supposed to be called once for init and then when rotate_timer
+ * expires, but it only gets executed if conditions are met anyways so
+ * you can call it more often.
  */
-void process_batch(void); /* prototype because we define it later */
 void update_log_file(void) {
     static struct tm *current;
     time_t time_left;
+    struct timespec now;
+
+    /*
+     * Not time(), which is a coarse clock and can still be a second
+     * behind when the timer expires
+     */
+    clock_gettime(CLOCK_REALTIME, &now);
 
     /* day is 0 when it's first time we call */
-    if (time(NULL) > time_limit || day == 0) {
+    if (now.tv_sec >= time_limit || day == 0) {
         /*
          * we would need to process the log entries that still use the old file
          */
         process_batch();
 
-        time_limit = time(NULL);
-        logfd_age = time_limit; /* all fd-s older than this will be closed */
+        time_limit = now.tv_sec;
+        /*
+         * Tell write_log we are done with the old name. It closes the
+         * files when all workers have said so, a worker that is behind
+         * may still have lines for them.
+         */
+        if (log_file[0]) {
+            self->batch->close.worker = self->id;
+            strcpy(self->batch->close.log_file, log_file);
+            self->batch = pipeline_submit(self->batch);
+        }
         current = localtime(&time_limit);
         day = current->tm_mday;
         strftime(log_file, 32, LOG_FILE_FORMAT, current);
+        if (gzip_level) {
+            strcat(log_file, ".gz");
+        }
         /*
          * Calculate number of seconds left to finish the day, add to time_limit.
          * This is gonna become the threshold for when to change the string.
@@ -302,265 +601,722 @@ void update_log_file(void) {
         time_limit += time_left;
 #endif
 
+        set_rotate_timer(time_limit);
+
         LOG_PRINTF(DEBUG_MIN, ZONE, "Log file name set to %s, next check %s",
                    log_file, ctime(&time_limit));
+    } else {
+        /* the clock was set */
+        set_rotate_timer(time_limit);
     }
 }
 
 /*
- * Process one log batch. To be called often (minutes)
+ * Time (ms) we can let a batch fill up: the flush latency target minus
+ * what the pipeline takes to write it, but at least a quarter of the target.
  */
-void process_batch(void) {
-    int i, pid;
-    static int delay = 1;
+int fill_time(void) {
+    int ms = max_flush_latency - pipeline_service_time() / 1000000;
+    int min = (max_flush_latency >= 4) ? max_flush_latency / 4 : 1;
 
-    if (!log_counter) {
-        return;
-    }
+    return (ms < min) ? min : ms;
+}
 
-    LOG_PRINTF(2, ZONE, "started processing batch, %d entries", log_counter);
-    /*
-     * Do something with the stuff we've accumulated
-     */
-    /*
-     * Detach process in background
-     */
-    if (detach) {
-        pid = fork();
-        i = 0;
-    } else {
-        pid = -1;
-        i = -1;
-        LOG_PRINTF(DEBUG_MIN, ZONE, "fg mode, staying in one piece (no fork)",
-                   debug);
-    }
-    if (pid < 0 && i == 0) {
-        log_printf(DEBUG_ERROR, ZONE,
-                   "fork(process_batch): \"%s\", running in same process, "
-                   "inserting delay=%ds", LAST_ERROR, delay);
-        /*
-         * This, in case the system is really busy, will give some
-         * breathing room before we do our stuff.
-         */
-        sleep(delay);
-        if (delay < MAX_FAILEDFORK_DELAY) {
-            delay *= 2; /* for every failure wait longer and longer */
-        }
-        /*
-         * switch to same process mode
-         */
-        i = -1; /* so we do not ignore all the signals below */
-    } else {
-        delay = 1; /* reset delay value */
-    }
-    if (pid <= 0) {
-        if (i == 0) {
-            /* setsid();  *//* so that parent doesn't have to clean up */
-#ifdef USE_SYSLOG
-            init_syslog( "process_batch", LOG_PID );
-#endif
-            write_log_pid = 0; /* make sure we don't kill it (search for atexit) */
-            signal(SIGHUP, SIG_IGN);
-            signal(SIGUSR1, SIG_IGN);
-            signal(SIGUSR2, SIG_IGN);
-            signal(SIGALRM, SIG_IGN);
-        }
-        /*
-         * Process the data
-         */
-        for (i = 0; i < log_counter; i++) {
-            process_entry(log_buffer + i);
-        }
+/*
+ * Batch size controller. From the time it took to collect this batch we
+ * get the arrival rate, and the next batch is sized to what arrives in
+ * fill_time(): large batches when busy to spread the cost of the flush,
+ * small ones when quiet. The flush timer still bounds the latency when
+ * traffic drops.
+ */
+void adjust_batch_size(worker_t *w) {
+    uint64_t elapsed = monotonic_ns() - w->batch->first_ns;
+    double rate;
+    int size;
 
-        if (pid == 0) {
-            /* setsid(); */
-            exit(0);
-        }
-    } else {
-        /*
-         * Record this child
-         */
-        if (i == 0) {
-            LOG_PRINTF(DEBUG_MAX, ZONE, "process_batch: forked child(PID=%d)",
-                       pid);
-            child_counter++;
-        }
+    if (elapsed < 1000000) {
+        elapsed = 1000000;
+    }
+    rate = w->batch->count * 1e9 / elapsed;
+    w->arrival_rate = w->arrival_rate
+        ? (w->arrival_rate * 3 + rate) / 4
+        : rate;
+
+    size = w->arrival_rate * fill_time() / 1000;
+    if (size < BATCH_MIN) {
+        size = BATCH_MIN;
+    } else if (size > LOG_ENTRIES) {
+        size = LOG_ENTRIES;
+    }
+    if (size != w->batch_size) {
+        LOG_PRINTF(DEBUG_MED, ZONE, "batch size %d -> %d (%.0f entries/s)",
+                   w->batch_size, size, w->arrival_rate);
+        w->batch_size = size;
     }
-    log_counter = 0;
-    update_log_file();
 }
 
 /*
- * Scan for separator in string, update char pointer and length
- * corresponding to the position of the character found:
- * where gets the address of the next character (after separator)
- * length is updated with the length of the rest of the string
- *
- * If separator cannot be found it returns 0
- * This is some sort of a customized and inlined version of memchr.
- */
-inline int find_sep(char **where, int *length, char sep) {
-    char *tmp = *where;
-    for (; *tmp != sep && *length; (*length)--, tmp++)
-        ;
-    if (!*length) {
-        return 0;
+ * Process one log batch. Called when the batch is full or the flush
+ * timer expires.
+ * The batch is queued for the formatter threads and we start filling
+ * the next one.
+ */
+void process_batch(void) {
+    if (!self->batch->count) {
+        return;
     }
-    *tmp = '\0';
-    *where = tmp + 1;
-    return (*length)--;
+    if (flush_armed) {
+        set_flush_timer(0);
+    }
+
+    LOG_PRINTF(2, ZONE, "started processing batch, %d entries",
+               self->batch->count);
+
+    adjust_batch_size(self);
+
+    memcpy(self->batch->log_file, log_file, sizeof(self->batch->log_file));
+    self->batch = pipeline_submit(self->batch);
 }
 
 /*
- * Parse one log entry and populate the log_entry structure
- * in the corresponding table slot
+ * Parse the log line received in this_entry->logline and populate the
+ * rest of the log_entry structure, according to the input format (see
+ * format.c). The line is split in place.
+ * If the line cannot be parsed the entry is marked with status 0 and
+ * will be skipped. Returns 1 if the entry is good.
  */
-void parse_entry(char *buffer, int length) {
-    /*
-     * I'll use the mem* family instead of their string counterparts
-     * because they might be faster
-     */
-    log_entry *this_entry;
-    char *pos, *tmp, *save;
-    char pointer;
-    /*
-     * Stop alarm clock
-     */
-    alarm(0);
-    /*
-     * Process received data
-     */
-    this_entry = log_buffer + log_counter;
+int parse_entry(log_entry *this_entry, int length) {
     this_entry->time = time(NULL);
-    memcpy(this_entry->logline, buffer, length); /* copy line */
-    pos = this_entry->logline;
 
+    if (!input_parse(this_entry, length)) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring \"%s\": does not match "
+                   "the input format", this_entry->logline);
+        this_entry->status = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Account for count entries just received (and parsed) in the batch
+ */
+void add_entries(int count) {
+    if (!count) {
+        return;
+    }
     /*
-     * Parse the source logline into its components.
-     * The format understood is defined in httpd-log.conf as:
-     * "%a\t%u\t%s\t%b\t%v\t%P\t%T\t%r\t%{Referer}i\t%{User-agent}\t"
+     * Start the flush clock with the first entry of the batch
      */
-    while (pos) { /* this loop will be executed only once though */
-
-        /* IP Address */
-        this_entry->hostip = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-
-        /* identd remote user (usually '-') */
-        this_entry->remote_user = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-
-        /* authenticated user, if any */
-        this_entry->user = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-
-        /* Status of request */
-        tmp = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-        this_entry->status = atoi(tmp);
-
-        /* Bytes transferred */
-        tmp = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-        this_entry->bytes = (*tmp == '-') ? -1 : atoi(tmp);
-
-        /* Virtual host (ServerName) */
-        this_entry->vhost = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-
-        /* save REQUEST */
-        save = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-        tmp = pos; /* so we have start and end of request */
-
-        /* Referrer */
-        this_entry->referrer = pos;
-        if (!find_sep(&pos, &length, LOG_FIELD_SEPARATOR))
-            break;
-
-        /* User Agent */
-        this_entry->user_agent = pos;
-        find_sep(&pos, &length, LOG_FIELD_SEPARATOR);
-
+    if (!self->batch->count) {
+        self->batch->first_ns = monotonic_ns();
+        set_flush_timer(fill_time());
+    }
+    self->batch->count += count;
+    if (self->batch->count >= self->batch_size) {
         /*
-         * Now go back and parse REQUEST to get to method, uri and protocol
-         * Looks like "GET /something HTTP/1.0"
+         * Process log entries
          */
-        pos = save;
-        length = tmp - pos - 1;
-        this_entry->method = pos;
-        if (!find_sep(&pos, &length, ' '))
-            break;
+        process_batch();
+    }
+}
 
-        this_entry->uri = pos;
-        if (!find_sep(&pos, &length, ' '))
-            break;
+/*
+ * Packed datagrams (see logger.h). The bytes of datagram slot i are in
+ * its entry (the first MSG_SIZE) and then in recv_overflow[i]; a datagram
+ * set aside in carry is in one piece, which looks the same to these
+ * functions with tail = head + MSG_SIZE.
+ */
+static int line_start[LOG_ENTRIES + PACKET_SIZE / 2 + 1];
+static int line_len[LOG_ENTRIES + PACKET_SIZE / 2 + 1];
+
+static inline char datagram_at(const char *head, const char *tail, int i) {
+    return (i < MSG_SIZE) ? head[i] : tail[i - MSG_SIZE];
+}
 
-        /* we are not interested in the protocol version right now */
-        this_entry->proto = pos;
-        pos = NULL;
+/*
+ * Copy length bytes from offset start of a datagram to out, which may be
+ * the head itself
+ */
+static void datagram_copy(const char *head, const char *tail, int start,
+                          int length, char *out) {
+    int n;
+
+    if (start < MSG_SIZE) {
+        n = (length < MSG_SIZE - start) ? length : MSG_SIZE - start;
+        memmove(out, head + start, n);
+        out += n;
+        start += n;
+        length -= n;
     }
+    if (length) {
+        memcpy(out, tail + start - MSG_SIZE, length);
+    }
+}
 
-    if (pos) {
-        /*
-         * This log's format could not be understood
-         * Ignore it. But first we need to restore the parsed portion
-         * (since we sprinkled some \0-s around during parsing).
-         */
-        save = this_entry->logline;
-        pointer = *pos;
-        *pos = '^';
-        for (tmp = pos; tmp >= save; tmp--) {
-            if (!*tmp) {
-                *tmp = '\'';
-            }
+/*
+ * Find the lines of a datagram (in starts/lens, room for PACKET_SIZE / 2
+ * + 1) and return how many there are. Empty lines are skipped, but there
+ * is always at least one line, so that every datagram has an entry.
+ */
+static int split_lines(const char *head, const char *tail, int length,
+                       int *starts, int *lens) {
+    int i, n, count, start, part;
+    static int newline[PACKET_SIZE];
+
+    /* the client ends the datagram with '\0' */
+    while (length && (datagram_at(head, tail, length - 1) == '\0'
+                      || datagram_at(head, tail, length - 1) == '\n')) {
+        length--;
+    }
+    part = (length < MSG_SIZE) ? length : MSG_SIZE;
+    n = scan_sep(head, part, '\n', newline, PACKET_SIZE);
+    if (length > MSG_SIZE) {
+        count = scan_sep(tail, length - MSG_SIZE, '\n', newline + n,
+                         PACKET_SIZE - n);
+        for (i = n; i < n + count; i++) {
+            newline[i] += MSG_SIZE;
         }
-        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring from '%c' in \"%s\" pos %d",
-                   pointer, save, pos - save);
-    } else {
+        n += count;
+    }
+    newline[n] = length;
 
-        if (++log_counter == LOG_ENTRIES) {
-            /*
-             * Process log entries
-             */
-            process_batch();
+    for (i = 0, count = 0, start = 0; i <= n; start = newline[i++] + 1) {
+        if (newline[i] > start) {
+            starts[count] = start;
+            lens[count++] = newline[i] - start;
         }
     }
-    /*
-     * Restart alarm clock. The handler must be set somewhere else.
-     */
-    alarm(LOG_TIMEOUT);
+    if (!count) {
+        starts[0] = lens[0] = 0;
+        count = 1;
+    }
+    return count;
 }
 
 /*
- * Function to clean up the child zombie (write_log)
+ * Decompress the framed datagram in slot i (see FRAME_MARK), in place.
+ * A datagram that cannot be decompressed is left empty.
  */
-void clean_write_log(void) {
-    int status;
-    if (write_log_pid) {
-        kill(write_log_pid, SIGTERM); /* make sure it dies with us */
-        waitpid(write_log_pid, &status, 0);
+static void expand_datagram(worker_t *w, int i, char *head) {
+    static char packed[PACKET_SIZE], plain[PACKET_SIZE];
+    int length = w->recv_len[i], expanded = -1;
+
+    datagram_copy(head, w->recv_overflow[i], 0, length, packed);
+    if (length > FRAME_LZ4_HEADER && packed[1] == FRAME_LZ4) {
+        expanded = lz4_decompress(packed + FRAME_LZ4_HEADER,
+                                  length - FRAME_LZ4_HEADER, plain,
+                                  PACKET_SIZE);
+        if (expanded != ((unsigned char) packed[2] << 8
+                         | (unsigned char) packed[3])) {
+            expanded = -1;
+        }
+    }
+    if (expanded < 0) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring %d byte datagram (bad frame)",
+                   length);
+        w->bad_frames++;
+        expanded = 0;
+    } else {
+        w->framed++;
+        w->framed_bytes += length;
+        w->expanded_bytes += expanded;
+    }
+    memcpy(head, plain, (expanded < MSG_SIZE) ? expanded : MSG_SIZE);
+    if (expanded > MSG_SIZE) {
+        memcpy(w->recv_overflow[i], plain + MSG_SIZE, expanded - MSG_SIZE);
     }
+    w->recv_len[i] = expanded;
 }
 
 /*
- * Function to spawn write_log helper process.
- * We have it as a function so we can call it again in case it dies.
+ * Put a line of a datagram in entry and parse it
  */
-pid_t spawn_write_log(void) {
-    pid_t pid;
-    static int counter = 0;
-    int complained = 0;
+static void take_line(worker_t *w, log_entry *entry, const char *head,
+                      const char *tail, int start, int length) {
+    w->lines_received++;
+    if (length > MSG_SIZE) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring %d byte line (too long)",
+                   length);
+        entry->logline[0] = '\0';
+        entry->status = 0;
+        return;
+    }
+    datagram_copy(head, tail, start, length, entry->logline);
+    entry->logline[length] = '\0';
 
-    write_log_pid = 0;
-    /*
+    LOG_PRINTF(DEBUG_MAX, ZONE, "%s", entry->logline);
+
+    parse_entry(entry, length);
+}
+
+/*
+ * Number of records in a binary datagram (see wire.h), 0 for text.
+ * A datagram that cannot hold the records its header claims is cut to
+ * a header without records (*length), which makes one empty entry.
+ */
+static int binary_records(worker_t *w, char *head, int *length) {
+    int count;
+
+    if (*length < WIRE_HEADER || (unsigned char) head[0] != FRAME_MARK
+        || head[1] != FRAME_BINARY) {
+        return 0;
+    }
+    count = (unsigned char) head[2] << 8 | (unsigned char) head[3];
+    if (count > (*length - WIRE_HEADER) / WIRE_MIN_RECORD) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring %d byte binary datagram "
+                   "(%d records)", *length, count);
+        w->bad_records++;
+        head[2] = head[3] = 0;
+        *length = WIRE_HEADER;
+        return 1;
+    }
+    return count ? count : 1;
+}
+
+/*
+ * Decode the next record of a binary datagram into entry. Once the
+ * datagram turns out to be bad the entries left are skipped.
+ */
+static void take_record(worker_t *w, log_entry *entry, wire_reader *r) {
+    int result = 0;
+
+    w->lines_received++;
+    entry->time = time(NULL);
+    if (r->pos < r->end && (result = input_decode(entry, r)) > 0) {
+        return;
+    }
+    if (r->pos >= r->end) {
+        entry->logline[0] = '\0';
+    } else if (result < 0) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring the rest of a binary "
+                   "datagram (bad record)");
+        w->bad_records++;
+        entry->logline[0] = '\0';
+        r->pos = r->end;
+    } else {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "ignoring \"%s\": does not match "
+                   "the input format", entry->logline);
+    }
+    entry->status = 0;
+}
+
+/*
+ * Turn the count datagrams just received into the free entries of the
+ * batch into log entries. The lines of a packed datagram are spread
+ * over the entries that follow it, in order; the datagrams are done
+ * from the last one backwards, so every line moves to an entry at or
+ * after its own, that has been emptied already.
+ * The lines are found once, their offsets kept in line_start/line_len
+ * from first_line[i] on until they are moved.
+ * Binary datagrams are copied out first and their records decoded
+ * straight into the entries.
+ * Datagrams whose lines do not fit in the batch any more are set aside
+ * and go to the next one.
+ */
+void take_datagrams(worker_t *w, int count) {
+    static char binary[PACKET_SIZE];
+    log_entry *entry = w->batch->entries + w->batch->count;
+    int room = LOG_ENTRIES - w->batch->count;
+    int lines_of[RECV_BATCH], records[RECV_BATCH], first_line[RECV_BATCH];
+    int i, k, n, lines, fit, carried, length;
+    wire_reader r;
+    char *carry;
+
+    for (i = 0, lines = 0, fit = count; i < count; i++) {
+        if (w->recv_len[i] > 1
+            && (unsigned char) entry[i].logline[0] == FRAME_MARK
+            && entry[i].logline[1] != FRAME_BINARY) {
+            expand_datagram(w, i, entry[i].logline);
+        }
+        if ((records[i] = binary_records(w, entry[i].logline,
+                                         &w->recv_len[i]))) {
+            lines_of[i] = records[i];
+            w->binary++;
+        } else if (fit < count) {
+            continue; /* carried, split later */
+        } else {
+            /*
+             * Up to here the lines fit in LOG_ENTRIES, plus the lines
+             * of this one
+             */
+            first_line[i] = lines;
+            lines_of[i] = split_lines(entry[i].logline, w->recv_overflow[i],
+                                      w->recv_len[i], line_start + lines,
+                                      line_len + lines);
+        }
+        if (fit == count) {
+            if (lines + lines_of[i] > room) {
+                fit = i;
+            } else {
+                lines += lines_of[i];
+            }
+        }
+    }
+
+    for (i = fit, carried = 0, carry = w->carry; i < count; i++) {
+        datagram_copy(entry[i].logline, w->recv_overflow[i], 0,
+                      w->recv_len[i], carry);
+        w->carry_len[carried++] = w->recv_len[i];
+        carry += w->recv_len[i];
+    }
+
+    for (i = fit - 1, k = lines; i >= 0; i--) {
+        if (records[i]) {
+            datagram_copy(entry[i].logline, w->recv_overflow[i], 0,
+                          w->recv_len[i], binary);
+            wire_start(&r, binary + WIRE_HEADER, w->recv_len[i] - WIRE_HEADER);
+            for (k -= records[i], n = 0; n < records[i]; n++) {
+                take_record(w, entry + k + n, &r);
+            }
+            continue;
+        }
+        for (n = first_line[i] + lines_of[i] - 1; n >= first_line[i]; n--) {
+            take_line(w, entry + --k, entry[i].logline, w->recv_overflow[i],
+                      line_start[n], line_len[n]);
+        }
+    }
+    add_entries(lines);
+
+    /*
+     * Rare: these have to be copied anyways
+     */
+    for (i = 0, carry = w->carry; i < carried; carry += w->carry_len[i++]) {
+        length = w->carry_len[i];
+        if ((lines = binary_records(w, carry, &length))) {
+            wire_start(&r, carry + WIRE_HEADER, length - WIRE_HEADER);
+            for (n = 0; n < lines; n++) {
+                take_record(w, w->batch->entries + w->batch->count, &r);
+                add_entries(1);
+            }
+            continue;
+        }
+        lines = split_lines(carry, carry + MSG_SIZE, w->carry_len[i],
+                            line_start, line_len);
+        for (n = 0; n < lines; n++) {
+            take_line(w, w->batch->entries + w->batch->count, carry,
+                      carry + MSG_SIZE, line_start[n], line_len[n]);
+            add_entries(1);
+        }
+    }
+}
+
+/*
+ * Point msg at the free entry i of the batch and its overflow
+ */
+static void recv_slot(worker_t *w, int i, struct msghdr *msg) {
+    log_entry *entry = w->batch->entries + w->batch->count + i;
+
+    w->recv_iov[i][0].iov_base = entry->logline;
+    w->recv_iov[i][0].iov_len = MSG_SIZE;
+    w->recv_iov[i][1].iov_base = w->recv_overflow[i];
+    w->recv_iov[i][1].iov_len = PACKET_SIZE - MSG_SIZE;
+    msg->msg_iov = w->recv_iov[i];
+    msg->msg_iovlen = 2;
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+}
+
+/*
+ * Sender of a datagram, for the debug messages. The ones received on
+ * the Unix socket have no IP address.
+ */
+static const char *peer_name(struct sockaddr_in *addr, socklen_t length) {
+    if (length < sizeof(*addr) || addr->sin_family != AF_INET) {
+        return "local client";
+    }
+    return inet_ntoa(addr->sin_addr);
+}
+
+/*
+ * Receive a single datagram with recvmsg() from sock into the next free
+ * entry of the batch and parse it.
+ * Returns the number of datagrams received (0 or 1).
+ */
+int receive_one(worker_t *w, int sock) {
+    struct sockaddr_in client;
+    struct msghdr msg;
+    int received;
+
+    recv_slot(w, 0, &msg);
+    msg.msg_name = &client;
+    msg.msg_namelen = sizeof(client);
+    if ((received = recvmsg(sock, &msg, 0)) < 0) {
+        /*
+         * The sockets are non-blocking, EAGAIN is the end of a drain
+         */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_printf(DEBUG_ERROR, ZONE, "recvmsg: %s", LAST_ERROR);
+        }
+        return 0;
+    }
+    w->packets_received++;
+
+    LOG_PRINTF(DEBUG_MAX, ZONE, "Received %d bytes from %s",
+               received, peer_name(&client, msg.msg_namelen));
+
+    w->recv_len[0] = received;
+    take_datagrams(w, 1);
+    return 1;
+}
+
+/*
+ * Drain up to recv_batch datagrams from sock with one recvmmsg()
+ * call, straight into the free entries of the batch, and parse each of
+ * them. Falls back to receive_one() when batching is disabled or not
+ * available.
+ * Returns the number of datagrams received.
+ */
+int receive_batch(worker_t *w, int sock) {
+#ifdef HAVE_RECVMMSG
+    int i, count, room;
+
+    /* the batch is submitted when full, so there is always room for one */
+    room = LOG_ENTRIES - w->batch->count;
+    if (room > recv_batch) {
+        room = recv_batch;
+    }
+    if (room < 2) {
+        return receive_one(w, sock);
+    }
+
+    for (i = 0; i < room; i++) {
+        recv_slot(w, i, &w->recv_msgs[i].msg_hdr);
+        w->recv_msgs[i].msg_hdr.msg_name = &w->recv_addr[i];
+        w->recv_msgs[i].msg_hdr.msg_namelen = sizeof(w->recv_addr[i]);
+    }
+
+    if ((count = recvmmsg(sock, w->recv_msgs, room, MSG_DONTWAIT,
+                          NULL)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_printf(DEBUG_ERROR, ZONE, "recvmmsg: %s", LAST_ERROR);
+        }
+        return 0;
+    }
+    w->recv_batches++;
+    w->recv_histogram[count]++;
+    w->packets_received += count;
+
+    for (i = 0; i < count; i++) {
+        w->recv_len[i] = w->recv_msgs[i].msg_len;
+        LOG_PRINTF(DEBUG_MAX, ZONE, "Received %d bytes from %s",
+                   w->recv_len[i],
+                   peer_name(&w->recv_addr[i],
+                             w->recv_msgs[i].msg_hdr.msg_namelen));
+    }
+    take_datagrams(w, count);
+    return count;
+#else
+    return receive_one(w, sock);
+#endif
+}
+
+/*
+ * Stream connections (--stream), by descriptor. The datagrams read from
+ * a connection go through the same slots of the batch as the received
+ * ones, so packed and compressed datagrams work the same way.
+ */
+typedef struct {
+    int length;                 /* bytes in buf */
+    char buf[STREAM_BUFFER];
+} stream_t;
+
+stream_t **streams = NULL;
+int streams_size = 0;
+
+/*
+ * Accept the pending connections on the stream listener
+ */
+void accept_streams(worker_t *w) {
+    int fd;
+
+    while ((fd = accept4(stream_sock, NULL, NULL,
+                         SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+        if (fd >= streams_size
+            || !(streams[fd] = (stream_t*) malloc(sizeof(stream_t)))) {
+            LOG_PRINTF(DEBUG_ERROR, ZONE, "WARNING: no room for stream "
+                       "connection %d, closing it", fd);
+            close(fd);
+            continue;
+        }
+        streams[fd]->length = 0;
+        add_event(fd);
+        w->connections++;
+        LOG_PRINTF(DEBUG_MED, ZONE, "stream connection %d", fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "accept(%s): %s", stream_spec,
+                   LAST_ERROR);
+    }
+}
+
+void close_stream(int fd, const char *why) {
+    LOG_PRINTF(DEBUG_MED, ZONE, "stream connection %d: %s", fd, why);
+    /* write_log may have the descriptor too, if it was forked since */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    free(streams[fd]);
+    streams[fd] = NULL;
+}
+
+/*
+ * Put a datagram read from a stream in the free slot i of the batch,
+ * where receive_batch() would have received it
+ */
+static void stream_slot(worker_t *w, int i, const char *data, int length) {
+    log_entry *entry = w->batch->entries + w->batch->count + i;
+
+    memcpy(entry->logline, data, (length < MSG_SIZE) ? length : MSG_SIZE);
+    if (length > MSG_SIZE) {
+        memcpy(w->recv_overflow[i], data + MSG_SIZE, length - MSG_SIZE);
+    }
+    w->recv_len[i] = length;
+}
+
+/*
+ * Read what came on stream connection fd and take the whole datagrams
+ * in it, up to recv_batch at a time. The rest waits for more input.
+ * Returns the number of datagrams taken.
+ */
+int receive_stream(worker_t *w, int fd) {
+    stream_t *s = streams[fd];
+    int received, start, length, count, room, total = 0, bad = 0;
+
+    if ((received = read(fd, s->buf + s->length,
+                         STREAM_BUFFER - s->length)) <= 0) {
+        if (!received) {
+            close_stream(fd, "closed");
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close_stream(fd, LAST_ERROR);
+        }
+        return 0;
+    }
+    s->length += received;
+
+    start = count = room = 0;
+    while (s->length - start >= STREAM_HEADER) {
+        length = ((unsigned char) s->buf[start] << 8)
+            | (unsigned char) s->buf[start + 1];
+        if (!length || length > PACKET_SIZE) {
+            LOG_PRINTF(DEBUG_ERROR, ZONE, "stream connection %d: bad "
+                       "datagram length %d", fd, length);
+            bad = 1;
+            break;
+        }
+        if (s->length - start - STREAM_HEADER < length) {
+            break;
+        }
+        if (count == room) {
+            /* take the ones so far, the batch may move on */
+            if (count) {
+                take_datagrams(w, count);
+                total += count;
+                count = 0;
+            }
+            room = LOG_ENTRIES - w->batch->count;
+            if (room > recv_batch) {
+                room = recv_batch;
+            }
+        }
+        stream_slot(w, count++, s->buf + start + STREAM_HEADER, length);
+        start += STREAM_HEADER + length;
+    }
+    if (count) {
+        take_datagrams(w, count);
+        total += count;
+    }
+    w->packets_received += total;
+    w->stream_frames += total;
+
+    if (bad) {
+        close_stream(fd, "bad datagram length");
+        return total;
+    }
+    memmove(s->buf, s->buf + start, s->length - start);
+    s->length -= start;
+    return total;
+}
+
+/*
+ * Receive from sock, one of the sockets wait_loop() found ready
+ */
+void receive_from(worker_t *w, int sock) {
+    if (sock == stream_sock) {
+        accept_streams(w);
+    } else if (sock < streams_size && streams[sock]) {
+        receive_stream(w, sock);
+    } else {
+        receive_batch(w, sock);
+    }
+}
+
+/*
+ * Log receive statistics, including how well recvmmsg() batching works.
+ */
+void log_stats(worker_t *w) {
+    int i;
+
+    LOG_PRINTF(0, ZONE, "Stats: worker %d: %d packets received, %lu lines.",
+               w->id, w->packets_received, w->lines_received);
+    if (w->connections) {
+        LOG_PRINTF(0, ZONE, "Stats: worker %d: %lu stream connections, "
+                   "%lu packets from streams.", w->id, w->connections,
+                   w->stream_frames);
+    }
+    if (w->binary) {
+        LOG_PRINTF(0, ZONE, "Stats: worker %d: %lu binary packets, "
+                   "%lu bad records.", w->id, w->binary, w->bad_records);
+    }
+    if (w->framed || w->bad_frames) {
+        LOG_PRINTF(0, ZONE, "Stats: worker %d: %lu compressed packets, "
+                   "%lu bytes expanded to %lu, %lu bad.", w->id, w->framed,
+                   w->framed_bytes, w->expanded_bytes, w->bad_frames);
+    }
+    LOG_PRINTF(0, ZONE, "Stats: worker %d: batch size %d (%d-%d), "
+               "%.0f entries/s, flush latency target %d ms.", w->id,
+               w->batch_size, BATCH_MIN, LOG_ENTRIES, w->arrival_rate,
+               max_flush_latency);
+    if (w->recv_batches) {
+        LOG_PRINTF(0, ZONE, "Stats: worker %d: %lu recvmmsg() batches, "
+                   "%.2f packets/batch.", w->id, w->recv_batches,
+                   (double) w->packets_received / w->recv_batches);
+        for (i = 1; i <= RECV_BATCH; i++) {
+            if (w->recv_histogram[i]) {
+                LOG_PRINTF(0, ZONE, "Stats:   %2d packets/batch: %lu times",
+                           i, w->recv_histogram[i]);
+            }
+        }
+    }
+    pipeline_stats();
+    if (!detach) { /* write_log runs in this process */
+        uring_stats();
+        fd_cache_stats();
+    }
+}
+
+/*
+ * Function to clean up the child zombie (write_log)
+ */
+void clean_write_log(void) {
+    int status;
+    if (write_log_pid) {
+        /* it exits after writing everything we sent */
+        close(write_log[1]);
+        waitpid(write_log_pid, &status, 0);
+    }
+}
+
+/*
+ * Function to spawn write_log helper process.
+ * We have it as a function so we can call it again in case it dies.
+ */
+pid_t spawn_write_log(void) {
+    pid_t pid;
+    static int counter = 0;
+    int complained = 0;
+
+    write_log_pid = 0;
+    /*
      * Try to fork child. If it doesn't work then log the error and keep
      * trying (don't give up). But don't complain too often.
      */
@@ -569,7 +1325,7 @@ pid_t spawn_write_log(void) {
             LOG_PRINTF(DEBUG_ERROR, ZONE, "fork(write_log): %s", LAST_ERROR);
         }
         complained = time(NULL);
-        sleep(10); /* we can use sleep because we know alarm() is not set */
+        sleep(10);
     }
 
     if (pid == 0) {
@@ -579,6 +1335,17 @@ pid_t spawn_write_log(void) {
 #ifdef USE_SYSLOG
         init_syslog( "write_log", LOG_PID );
 #endif
+        /*
+         * We exit when all the senders have closed the socket (i.e. are
+         * gone), so there is nothing left unwritten.
+         */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        child_events();
+        close(write_log[1]);
         write_log_process(write_log);
         DIE_ERROR(0, ZONE, "write_log process exited.");
         /*
@@ -599,46 +1366,25 @@ pid_t spawn_write_log(void) {
     return pid;
 }
 
-int main(int argc, char** argv) {
-
-    struct sockaddr_in logserv, client;
-    struct hostent *info;
-    socklen_t length;
-
-    int received, retries;
-    int store_action;
-
-#ifdef USE_SYSLOG
-    init_syslog( "logserver", LOG_PID );
-#endif
-    command_line(argc, argv);
-
-    /*
-     * Should not rely on current directory after calling log_entry though...
-     */
-    if (chdir(logger_spool)) {
-        DIE_ERROR(5, ZONE, "chdir %s: %s", logger_spool, LAST_ERROR);
-    } else {
-        LOG_PRINTF(DEBUG_MAX, ZONE, "Using spool dir \"%s\"", logger_spool);
-    }
-    if (!(info = gethostbyaddr(host, strlen(host), 0))) {
-        if (!(info = gethostbyname(host))) {
-            DIE_ERROR(1, ZONE, "gethostbyname( %s ): %s", host, LAST_ERROR);
-        }
-    }
+/*
+ * Create a UDP socket bound to addr, optionally with SO_REUSEPORT so that
+ * several workers can share the port. Retries for a while if the address
+ * is busy. Returns the socket.
+ */
+int bind_socket(struct sockaddr_in *addr, int reuseport) {
+    int sock, retries;
+    int on = 1;
 
     if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         DIE_ERROR(1, ZONE, "socket(SOCK_DGRAM): %s", LAST_ERROR);
     }
-
-    bzero((char*) &logserv, sizeof(logserv));
-    logserv.sin_family = AF_INET;
-    logserv.sin_port = htons(port);
-    logserv.sin_addr = *((struct in_addr*) info->h_addr);
+    if (reuseport
+        && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+        DIE_ERROR(1, ZONE, "setsockopt(SO_REUSEPORT): %s", LAST_ERROR);
+    }
 
     retries = 7; /* should be defineable */
-    while (retries && bind(sock, (struct sockaddr*) &logserv, sizeof(logserv))
-            < 0) {
+    while (retries && bind(sock, (struct sockaddr*) addr, sizeof(*addr)) < 0) {
         retries--;
         if (retries) {
             LOG_PRINTF(DEBUG_ERROR, ZONE,
@@ -656,82 +1402,161 @@ int main(int argc, char** argv) {
     } else {
         LOG_PRINTF(DEBUG_MIN, ZONE, "Listening on %s port %d", host, port);
     }
+    return sock;
+}
 
-    length = sizeof(client);
+/*
+ * Create a Unix socket of the given type bound to path (replacing a
+ * socket left there by an earlier run). Returns the socket.
+ */
+int bind_unix(const char *path, int type) {
+    struct sockaddr_un addr;
+    int sock;
 
-    /*
-     * Create pipe for communication with the write_log process
-     */
-    if (pipe(write_log)) {
-        DIE_ERROR(3, ZONE, "pipe(): %s", LAST_ERROR);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        DIE_ERROR(1, ZONE, "%s: path too long for a Unix socket", path);
     }
+    bzero((char*) &addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-    /*
-     * Fork the daemons
-     */
-    if (detach) {
-        /*
-         * Detach main process
-         */
-        switch ((received = fork())) {
-
-        case -1: /* error */
-            DIE_ERROR(2, ZONE, "fork(main): %s", LAST_ERROR);
+    if ((sock = socket(AF_UNIX, type | SOCK_NONBLOCK, 0)) < 0) {
+        DIE_ERROR(1, ZONE, "socket(AF_UNIX): %s", LAST_ERROR);
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        DIE_ERROR(1, ZONE, "Cannot bind to %s: %s, exiting", path, LAST_ERROR);
+    }
+    LOG_PRINTF(DEBUG_MIN, ZONE, "Listening on %s", path);
+    return sock;
+}
 
-        case 0: /* child - will outlive parent and will stay in background */
-            if (!debug) {
-                close(0);
-                close(1);
-                close(2);
-                setsid();
+/*
+ * Open the stream listener given by --stream: unix:PATH or
+ * tcp:[HOST:]PORT. Returns the socket.
+ */
+int listen_stream(const char *spec) {
+    struct sockaddr_in addr;
+    struct hostent *info;
+    char name[HOSTNAME_SIZE + 1];
+    const char *colon;
+    int sock = -1, on = 1;
+
+    if (!strncmp(spec, "unix:", 5)) {
+        sock = bind_unix(spec + 5, SOCK_STREAM);
+    } else if (!strncmp(spec, "tcp:", 4)) {
+        bzero((char*) &addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        spec += 4;
+        if ((colon = strrchr(spec, ':'))) {
+            snprintf(name, sizeof(name), "%.*s", (int) (colon - spec), spec);
+            if (!(info = gethostbyname(name))) {
+                DIE_ERROR(1, ZONE, "gethostbyname( %s ): %s", name,
+                          LAST_ERROR);
             }
-            break;
-
-        default: /* parent */
-            DIE_ERROR(0, ZONE, "logserver_main detached with PID %d", received);
+            addr.sin_addr = *((struct in_addr*) info->h_addr);
+            spec = colon + 1;
         }
-        /*
-         * Only the child reaches this point; the parent has exited above.
-         *
-         * Fork the write_log helper process
-         */
-        spawn_write_log();
+        addr.sin_port = htons(atoi(spec) ? atoi(spec) : LOGGER_PORT);
 
+        if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+            DIE_ERROR(1, ZONE, "socket(SOCK_STREAM): %s", LAST_ERROR);
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            DIE_ERROR(1, ZONE, "Cannot bind to %s: %s, exiting", stream_spec,
+                      LAST_ERROR);
+        }
+        LOG_PRINTF(DEBUG_MIN, ZONE, "Listening on %s", stream_spec);
     } else {
-        LOG_PRINTF(DEBUG_ERROR, ZONE, "Running in foreground, pid %d", getpid());
+        DIE_ERROR(1, ZONE, "--stream %s: not unix:PATH or tcp:[HOST:]PORT",
+                  spec);
+    }
+    if (listen(sock, SOMAXCONN) < 0) {
+        DIE_ERROR(1, ZONE, "listen(%s): %s", stream_spec, LAST_ERROR);
     }
+    return sock;
+}
+
+/*
+ * Attach a classic BPF program to the SO_REUSEPORT group of sock that
+ * picks the worker by source address, so that all the packets from one
+ * client are handled (and ordered) by the same worker.
+ * Without it the kernel hashes the 4-tuple, which is almost as good.
+ */
+void attach_steering(int sock, int n) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        /* A = source address, from the IP header */
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+        /* A = A % n */
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, n },
+        /* return A, the index of the socket in the group */
+        { BPF_RET | BPF_A,             0, 0, 0 }
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog))) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE,
+                   "WARNING: setsockopt(SO_ATTACH_REUSEPORT_CBPF): %s, "
+                   "using default packet steering", LAST_ERROR);
+    }
+#else
+    LOG_PRINTF(DEBUG_MIN, ZONE, "BPF packet steering not available, "
+               "using default packet steering");
+#endif
+}
+
+/*
+ * Main loop of a worker. Never returns.
+ * init_events() has to be called with the worker socket before this.
+ * Worker 0 also serves the Unix socket and the stream connections, so
+ * that the lines from a local client stay in order.
+ */
+void run_worker(int id, int sock) {
+    int received, i;
+    int store_action;
 
-    signal(SIGINT, signal_catch);
-    signal(SIGTERM, signal_catch);
-    signal(SIGHUP, signal_catch);
-    signal(SIGUSR1, signal_catch);
-    signal(SIGUSR2, signal_catch);
-    signal(SIGALRM, signal_catch);
+    if (!(self = (worker_t*) calloc(1, sizeof(worker_t)))) {
+        DIE_ERROR(6, ZONE, "could not allocate worker %d", id);
+    }
+    self->id = id;
+    self->sock = sock;
+    self->batch_size = BATCH_MIN;
+    self->batch = pipeline_start(formatters, queue_depth, pipeline_memory,
+                                 write_log);
+    LOG_PRINTF(DEBUG_MIN, ZONE, "worker %d: using %s field scanner",
+               id, scan_impl());
+
+    if (id == 0) {
+        if (unix_sock >= 0) {
+            add_event(unix_sock);
+        }
+        if (stream_sock >= 0) {
+            streams_size = getdtablesize();
+            if (!(streams = (stream_t**) calloc(streams_size,
+                                                sizeof(stream_t*)))) {
+                DIE_ERROR(6, ZONE, "could not allocate the stream table");
+            }
+            add_event(stream_sock);
+        }
+    }
 
     update_log_file(); /* Make sure we have a valid log file name */
 
     /*
      * Main server loop
      */
-    while ((received = wait_loop(sock))) {
+    while ((received = wait_loop())) {
         switch (received) {
 
         case MSG_IN_QUEUE:
-            if ((received = recvfrom(sock, buffer, MSG_SIZE, 0,
-                    (struct sockaddr*) &client, &length)) >= 0) {
-                buffer[received] = '\0';
-
-                LOG_PRINTF(DEBUG_MAX, ZONE, "Received %d bytes from %s",
-                           received, inet_ntoa(client.sin_addr));
-                LOG_PRINTF(DEBUG_MAX, ZONE, "%s", buffer);
-
-                parse_entry(buffer, received);
-
-            } else {
-                /*
-                 * This should probably be done using syslog()
-                 */
-                log_printf(DEBUG_ERROR, ZONE, "recvfrom: %s", LAST_ERROR);
+            for (i = 0; i < ready_count; i++) {
+                receive_from(self, ready[i]);
             }
             break;
 
@@ -742,11 +1567,14 @@ int main(int argc, char** argv) {
             store_action = action; /* save signal value as it may change */
             switch (store_action) {
 
-            case SIGALRM:
             case SIGHUP:
                 action = 0;
                 process_batch();
-                signal(action, signal_catch); /* restore handler after op. */
+                break;
+
+            case SIGUSR1:
+                action = 0;
+                log_stats(self);
                 break;
 
             case SIGTERM:
@@ -758,11 +1586,8 @@ int main(int argc, char** argv) {
                 LOG_PRINTF(DEBUG_MIN, ZONE, "Caught signal %d (%s)",
                            store_action, SIGNAL_NAME(store_action));
                 process_batch();
-                if (write_log_pid) {
-                    kill(write_log_pid, SIGTERM);
-                }
-                LOG_PRINTF(0, ZONE, "Stats: %d packets received.",
-                           packets_received);
+                pipeline_drain();
+                log_stats(self);
                 DIE_ERROR(0, ZONE, "Exiting on signal %d (%s)", store_action,
                           SIGNAL_NAME(store_action));
             }
@@ -770,5 +1595,224 @@ int main(int argc, char** argv) {
     }
     close(sock);
     DIE_ERROR(0, ZONE, "Exiting abnormally. You should never see this message.");
+}
+
+/*
+ * Fork worker process number id. (Re)spawned by the supervisor.
+ */
+pid_t spawn_worker(int id) {
+    pid_t pid;
+
+    while ((pid = fork()) < 0) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "fork(worker %d): %s", id, LAST_ERROR);
+        sleep(1);
+    }
+
+    if (pid == 0) {
+#ifdef USE_SYSLOG
+        init_syslog( "worker", LOG_PID );
+#endif
+        write_log_pid = 0; /* it belongs to the supervisor */
+        child_events();
+        init_events(worker_socks[id]);
+        run_worker(id, worker_socks[id]);
+    }
+
+    worker_pids[id] = pid;
+    LOG_PRINTF(DEBUG_MIN, ZONE, "worker %d running (PID %d)", id, pid);
+    return pid;
+}
+
+/*
+ * Main loop of the supervisor (--workers > 1). The workers do all the
+ * receiving; here we respawn them (and write_log) when they die and pass
+ * signals on to them. Never returns.
+ */
+void supervise(void) {
+    struct epoll_event event;
+    struct signalfd_siginfo info;
+    int i, status;
+    pid_t pid;
+
+    while (1) {
+        if (epoll_wait(epoll_fd, &event, 1, -1) < 0) {
+            continue;
+        }
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            switch (info.ssi_signo) {
+
+            case SIGCHLD:
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                    if (pid == write_log_pid) {
+                        LOG_PRINTF(DEBUG_ERROR, ZONE,
+                                   "WARNING: write_log (PID %d) died, "
+                                   "trying to respawn", pid);
+                        spawn_write_log();
+                        continue;
+                    }
+                    for (i = 0; i < workers; i++) {
+                        if (worker_pids[i] == pid) {
+                            LOG_PRINTF(DEBUG_ERROR, ZONE,
+                                       "WARNING: worker %d (PID %d) died, "
+                                       "trying to respawn", i, pid);
+                            spawn_worker(i);
+                        }
+                    }
+                }
+                break;
+
+            case SIGHUP:
+            case SIGUSR1:
+            case SIGUSR2:
+                for (i = 0; i < workers; i++) {
+                    kill(worker_pids[i], info.ssi_signo);
+                }
+                break;
+
+            default:
+                LOG_PRINTF(DEBUG_MIN, ZONE, "Caught signal %d (%s)",
+                           info.ssi_signo, SIGNAL_NAME(info.ssi_signo));
+                for (i = 0; i < workers; i++) {
+                    kill(worker_pids[i], SIGTERM);
+                }
+                for (i = 0; i < workers; i++) {
+                    waitpid(worker_pids[i], &status, 0);
+                }
+                DIE_ERROR(0, ZONE, "Exiting on signal %d (%s)", info.ssi_signo,
+                          SIGNAL_NAME(info.ssi_signo));
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+
+    struct sockaddr_in logserv;
+    struct hostent *info;
+    char error[128];
+
+    int received, i;
+
+#ifdef USE_SYSLOG
+    init_syslog( "logserver", LOG_PID );
+#endif
+    command_line(argc, argv);
+
+    if (input_compile(input_format, error, sizeof(error))) {
+        DIE_ERROR(4, ZONE, "--input-format \"%s\": %s", input_format, error);
+    }
+    if (format_compile(output_format, error, sizeof(error))) {
+        DIE_ERROR(4, ZONE, "--format \"%s\": %s", output_format, error);
+    }
+
+    if (workers > 1 && !detach) {
+        LOG_PRINTF(DEBUG_ERROR, ZONE,
+                   "WARNING: --workers needs --daemon, using one worker");
+        workers = 1;
+    }
+
+    /*
+     * Should not rely on current directory after calling log_entry though...
+     */
+    if (chdir(logger_spool)) {
+        DIE_ERROR(5, ZONE, "chdir %s: %s", logger_spool, LAST_ERROR);
+    } else {
+        LOG_PRINTF(DEBUG_MAX, ZONE, "Using spool dir \"%s\"", logger_spool);
+    }
+    if (!(info = gethostbyaddr(host, strlen(host), 0))) {
+        if (!(info = gethostbyname(host))) {
+            DIE_ERROR(1, ZONE, "gethostbyname( %s ): %s", host, LAST_ERROR);
+        }
+    }
+
+    bzero((char*) &logserv, sizeof(logserv));
+    logserv.sin_family = AF_INET;
+    logserv.sin_port = htons(port);
+    logserv.sin_addr = *((struct in_addr*) info->h_addr);
+
+    /*
+     * One socket per worker, all in the same SO_REUSEPORT group.
+     * They are kept open by the main process so that a respawned worker
+     * finds its socket (and the queued packets) in the same place.
+     */
+    worker_socks = (int*) malloc(workers * sizeof(int));
+    worker_pids = (pid_t*) malloc(workers * sizeof(pid_t));
+    if (!worker_socks || !worker_pids) {
+        DIE_ERROR(6, ZONE, "could not allocate worker table");
+    }
+    for (i = 0; i < workers; i++) {
+        worker_socks[i] = bind_socket(&logserv, workers > 1);
+    }
+    if (workers > 1) {
+        attach_steering(worker_socks[0], workers);
+    }
+    if (unix_path) {
+        unix_sock = bind_unix(unix_path, SOCK_DGRAM);
+    }
+    if (stream_spec) {
+        stream_sock = listen_stream(stream_spec);
+    }
+
+    /*
+     * Create socket pair for communication with the write_log process.
+     * SOCK_SEQPACKET keeps the frames (batches) whole and atomic even
+     * with several workers sending.
+     */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, write_log)) {
+        DIE_ERROR(3, ZONE, "socketpair(): %s", LAST_ERROR);
+    }
+
+    /*
+     * Fork the daemons
+     */
+    if (detach) {
+        /*
+         * Detach main process
+         */
+        switch ((received = fork())) {
+
+        case -1: /* error */
+            DIE_ERROR(2, ZONE, "fork(main): %s", LAST_ERROR);
+
+        case 0: /* child - will outlive parent and will stay in background */
+            if (!debug) {
+                close(0);
+                close(1);
+                close(2);
+                setsid();
+            }
+            break;
+
+        default: /* parent */
+            DIE_ERROR(0, ZONE, "logserver_main detached with PID %d", received);
+        }
+        /*
+         * Only the child reaches this point; the parent has exited above.
+         */
+    } else {
+        LOG_PRINTF(DEBUG_ERROR, ZONE, "Running in foreground, pid %d", getpid());
+    }
+
+    /*
+     * The signalfd has to be set up by the process that reads it
+     */
+    init_events((workers > 1) ? -1 : worker_socks[0]);
+
+    if (detach) {
+        /*
+         * Fork the write_log helper process
+         */
+        spawn_write_log();
+    }
+
+    if (workers == 1) {
+        run_worker(0, worker_socks[0]);
+    }
+
+    for (i = 0; i < workers; i++) {
+        spawn_worker(i);
+    }
+    supervise();
+
     return 0; /* make GCC happy */
 }
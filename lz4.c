@@ -0,0 +1,341 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * LZ4 block compression. A compressed block is a list of sequences,
+ * each a token (literal length << 4 | match length - 4), the literals
+ * and a 2 byte match offset; lengths of 15 or more continue in the
+ * bytes that follow, 255 at a time. The last sequence only has
+ * literals. As in the reference implementation, the last 5 bytes are
+ * always literals and no match starts in the last 12.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+static const char *VERSION __attribute__ ((used)) = "$Id$";
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "lz4.h"
+#include "debug.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define HASH_LOG 12
+
+static inline unsigned read32(const unsigned char *p) {
+    unsigned v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned hash32(unsigned v) {
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/*
+ * Length of 15 or more: the rest in bytes of 255
+ */
+static inline unsigned char *put_length(unsigned char *op, int length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+/*
+ * Write a sequence: the literals from anchor to ip, then the match (none
+ * if match is 0). Returns the new end of the output or NULL if it does
+ * not fit before end.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end,
+                                   const unsigned char *anchor,
+                                   const unsigned char *ip, int offset,
+                                   int match) {
+    int literals = ip - anchor;
+    unsigned char *token = op++;
+
+    if (op + literals + literals / 255 + 1 + 2 + match / 255 + 1 > end) {
+        return NULL;
+    }
+    *token = ((literals < 15) ? literals : 15) << 4;
+    if (literals >= 15) {
+        op = put_length(op, literals);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (!match) {
+        return op;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match -= MIN_MATCH;
+    *token |= (match < 15) ? match : 15;
+    if (match >= 15) {
+        op = put_length(op, match);
+    }
+    return op;
+}
+
+int lz4_compress(const char *src, int length, char *dst, int size) {
+    unsigned short table[1 << HASH_LOG];
+    const unsigned char *in = (const unsigned char*) src;
+    const unsigned char *ip = in, *anchor = in, *ref;
+    const unsigned char *limit, *match_end;
+    unsigned char *op = (unsigned char*) dst, *end = op + size;
+    unsigned h;
+    int match;
+
+    if (length < 0 || length > LZ4_MAX_INPUT) {
+        return -1;
+    }
+    memset(table, 0, sizeof(table));
+    limit = in + ((length > MATCH_LIMIT) ? length - MATCH_LIMIT : 0);
+    match_end = in + length - LAST_LITERALS;
+
+    while (ip < limit) {
+        h = hash32(read32(ip));
+        ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || read32(ref) != read32(ip)) {
+            ip++;
+            continue;
+        }
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        for (match = MIN_MATCH; ip + match < match_end && ip[match] == ref[match];
+             match++)
+            ;
+        if (!(op = put_sequence(op, end, anchor, ip, ip - ref, match))) {
+            return -1;
+        }
+        ip += match;
+        anchor = ip;
+    }
+    if (!(op = put_sequence(op, end, anchor, in + length, 0, 0))) {
+        return -1;
+    }
+    return op - (unsigned char*) dst;
+}
+
+/*
+ * Read the rest of a length of 15 or more. Returns -1 past the end.
+ */
+static inline int get_length(const unsigned char **ip,
+                             const unsigned char *end, int length) {
+    unsigned char b;
+
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+int lz4_decompress(const char *src, int length, char *dst, int size) {
+    const unsigned char *ip = (const unsigned char*) src, *end = ip + length;
+    unsigned char *op = (unsigned char*) dst, *out_end = op + size;
+    const unsigned char *ref;
+    int token, literals, offset, match;
+
+    for (;;) {
+        if (ip >= end) {
+            return -1;
+        }
+        token = *ip++;
+        literals = token >> 4;
+        if (literals == 15 && (literals = get_length(&ip, end, 15)) < 0) {
+            return -1;
+        }
+        if (literals > end - ip || literals > out_end - op) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            return op - (unsigned char*) dst; /* the last sequence */
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > op - (unsigned char*) dst) {
+            return -1;
+        }
+        match = token & 15;
+        if (match == 15 && (match = get_length(&ip, end, 15)) < 0) {
+            return -1;
+        }
+        match += MIN_MATCH;
+        if (match > out_end - op) {
+            return -1;
+        }
+        ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            while (match--) { /* overlapping, repeats the last bytes */
+                *op++ = *ref++;
+            }
+        }
+    }
+}
+
+/*
+ * Benchmark
+ */
+#define BENCH_NS 200000000L /* run each pass for at least this long */
+
+static long cpu_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void lz4_benchmark(const char *file, int packet, int header) {
+    int *start, *len, *packed_len;
+    int count, i, n, line, rounds, fd, length;
+    unsigned long plain = 0, sent = 0, lines = 0;
+    char *data, *packed, *out, *back;
+    long ns, compress_ns, decompress_ns;
+    double mb;
+    struct stat st;
+
+    if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st)) {
+        DIE_ERROR(7, ZONE, "lz4 benchmark: %s: %s", file, LAST_ERROR);
+    }
+    length = (st.st_size < (1 << 30)) ? st.st_size : (1 << 30);
+    if (!(data = (char*) malloc(length + 1))) {
+        DIE_ERROR(6, ZONE, "could not allocate %d bytes for %s", length, file);
+    }
+    for (i = 0; i < length; i += n) {
+        if ((n = read(fd, data + i, length - i)) <= 0) {
+            DIE_ERROR(7, ZONE, "lz4 benchmark: read(%s): %s", file,
+                      n ? LAST_ERROR : "short file");
+        }
+    }
+    close(fd);
+
+    /*
+     * Cut the data into datagrams of whole lines, as the client packs them
+     */
+    n = length / 2 + 1;
+    start = (int*) malloc(n * sizeof(int));
+    len = (int*) malloc(n * sizeof(int));
+    packed_len = (int*) malloc(n * sizeof(int));
+    packed = (char*) malloc(LZ4_BOUND(length) + n * 16);
+    out = (char*) malloc(LZ4_BOUND(LZ4_MAX_INPUT));
+    back = (char*) malloc(LZ4_MAX_INPUT);
+    if (!start || !len || !packed_len || !packed || !out || !back) {
+        DIE_ERROR(6, ZONE, "could not allocate the benchmark buffers");
+    }
+    for (i = 0, count = 0; i < length; i = line + 1) {
+        const char *newline = memchr(data + i, '\n', length - i);
+
+        line = newline ? newline - data : length;
+        if (line == i || line - i > LZ4_MAX_INPUT) {
+            continue;
+        }
+        lines++;
+        if (count && packet && line - start[count - 1] <= packet
+            && start[count - 1] + len[count - 1] == i - 1) {
+            len[count - 1] = line - start[count - 1];
+            continue;
+        }
+        start[count] = i;
+        len[count++] = line - i;
+    }
+    if (!count) {
+        DIE_ERROR(1, ZONE, "lz4 benchmark: no lines in %s", file);
+    }
+
+    for (i = 0, n = 0; i < count; i++) {
+        packed_len[i] = lz4_compress(data + start[i], len[i], packed + n,
+                                     LZ4_BOUND(len[i]));
+        if (packed_len[i] < 0
+            || lz4_decompress(packed + n, packed_len[i], back,
+                              LZ4_MAX_INPUT) != len[i]
+            || memcmp(back, data + start[i], len[i])) {
+            DIE_ERROR(1, ZONE, "lz4 benchmark: datagram %d does not "
+                      "decompress to what it was", i);
+        }
+        plain += len[i];
+        /* what the client sends: the smaller one, with the header */
+        sent += (packed_len[i] + header < len[i])
+            ? packed_len[i] + header : len[i];
+        n += packed_len[i];
+    }
+
+    ns = cpu_ns();
+    rounds = 0;
+    do {
+        for (i = 0; i < count; i++) {
+            lz4_compress(data + start[i], len[i], out, LZ4_BOUND(len[i]));
+        }
+        rounds++;
+    } while ((compress_ns = cpu_ns() - ns) < BENCH_NS);
+    compress_ns /= rounds;
+
+    ns = cpu_ns();
+    rounds = 0;
+    do {
+        for (i = 0, n = 0; i < count; n += packed_len[i++]) {
+            lz4_decompress(packed + n, packed_len[i], back, LZ4_MAX_INPUT);
+        }
+        rounds++;
+    } while ((decompress_ns = cpu_ns() - ns) < BENCH_NS);
+    decompress_ns /= rounds;
+
+    mb = plain / 1048576.0;
+    LOG_PRINTF(0, ZONE, "lz4 benchmark: %lu lines in %d datagrams of up to "
+               "%d bytes: %lu bytes sent instead of %lu (%.1f%% saved)",
+               lines, count, packet, sent, plain,
+               100.0 - 100.0 * sent / plain);
+    LOG_PRINTF(0, ZONE, "lz4 benchmark: compress %.2f ms CPU/MB (%.0f MB/s), "
+               "decompress %.2f ms CPU/MB (%.0f MB/s)",
+               compress_ns / 1e6 / mb, mb * 1e9 / compress_ns,
+               decompress_ns / 1e6 / mb, mb * 1e9 / decompress_ns);
+
+    free(data);
+    free(start);
+    free(len);
+    free(packed_len);
+    free(packed);
+    free(out);
+    free(back);
+}
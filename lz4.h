@@ -0,0 +1,67 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Compression of the datagrams (httpd-logger --compress). This is the
+ * LZ4 block format, with a compressor small enough to live here: one
+ * hash table probe per position, no dictionary, inputs of at most 64 KB.
+ * Access log lines are very repetitive, so even that gets most of the
+ * ratio that matters.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+/*
+ * Largest input, the match offsets are 16 bits
+ */
+#define LZ4_MAX_INPUT 65535
+
+/*
+ * Room needed for the compressed form of length bytes, in the worst case
+ */
+#define LZ4_BOUND(length) ((length) + (length) / 255 + 16)
+
+/*
+ * Compress length bytes of src into dst (room for size bytes).
+ * Returns the compressed length, or -1 if it does not fit.
+ */
+int lz4_compress(const char *src, int length, char *dst, int size);
+
+/*
+ * Decompress length bytes of src into dst (room for size bytes).
+ * Returns the original length, or -1 if src is not valid or does not fit.
+ * Safe on any input.
+ */
+int lz4_decompress(const char *src, int length, char *dst, int size);
+
+/*
+ * Compress the lines of file (separated by '\n') the way httpd-logger
+ * would send them, up to packet bytes per datagram or one
+ * line per datagram if packet is 0, and log the CPU time per MB of
+ * compressing and decompressing and the bytes saved. header is the size
+ * of the frame header in front of a compressed datagram.
+ */
+void lz4_benchmark(const char *file, int packet, int header);
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Batch pipeline. Replaces the child process that used to be forked
+ * for every batch with long-lived threads:
+ *
+ *   receiver --> formatter threads --> writer thread --> write_log
+ *
+ * The formatters turn the entries into REC_LINE records and the writer
+ * sends each batch to write_log as one frame (see logger.h).
+ *
+ * The batches live in a ring. The receiver fills the one at head, the
+ * formatters take them in turn and the writer sends them out from tail
+ * so that the order of the log lines is preserved. The ring is bounded;
+ * if it is full the receiver waits for the writer.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+static const char *VERSION __attribute__ ((used)) = "$Id$";
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "pipeline.h"
+#include "debug.h"
+
+/* batch states */
+#define BATCH_FILLING   0 /* owned by the receiver          */
+#define BATCH_QUEUED    1 /* waiting for / being formatted  */
+#define BATCH_FORMATTED 2 /* waiting for the writer         */
+
+extern int detach;
+
+static batch_t *ring;
+static int ring_size;
+static int *write_log;
+/*
+ * Sequence numbers: head is being filled, batches before format_next
+ * have been picked up by a formatter, batches before tail are written.
+ */
+static unsigned long head, format_next, tail;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t can_fill = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t can_format = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t can_write = PTHREAD_COND_INITIALIZER;
+
+/* queue depth counters */
+static int formatter_count;
+static unsigned long max_depth;
+static unsigned long stalls;    /* receiver had to wait for a free batch */
+static unsigned long entries;
+
+/* flush latency, first entry received to batch written (ns) */
+static uint64_t latency_total, latency_max, latency_count;
+static uint64_t service_avg;    /* moving average of submit to written */
+
+/*
+ * Send one frame to write_log. In foreground mode there is no write_log
+ * process, call it inline to consume the frame.
+ */
+static void send_frame(const char *frame, int size) {
+    while (send(write_log[1], frame, size, 0) < 0) {
+        if (errno != EINTR) {
+            DIE_ERROR(1, ZONE, "send(write_log, %d): %s", size, LAST_ERROR);
+        }
+    }
+    if (!detach) {
+        write_log_process(write_log);
+    }
+}
+
+/*
+ * Send the batch to write_log, normally as one frame. The REC_CLOSE
+ * record, if any, goes after the lines of the batch.
+ */
+static void write_batch(batch_t *batch) {
+    char *pos, *frame, *end;
+    record_hdr *hdr;
+    int size;
+
+    if (batch->close.log_file[0]) {
+        hdr = (record_hdr*) (batch->out + batch->out_len);
+        hdr->type = REC_CLOSE;
+        hdr->path_len = 0;
+        hdr->line_len = sizeof(close_rec);
+        memcpy(hdr + 1, &batch->close, sizeof(close_rec));
+        batch->out_len += REC_SIZE(hdr);
+    }
+
+    frame = pos = batch->out;
+    end = batch->out + batch->out_len;
+    while (pos < end) {
+        size = REC_SIZE((record_hdr*) pos);
+        if (pos + size - frame > WRITE_LOG_FRAME_SIZE) {
+            send_frame(frame, pos - frame);
+            frame = pos;
+        }
+        pos += size;
+    }
+    if (pos > frame) {
+        send_frame(frame, pos - frame);
+    }
+}
+
+/*
+ * Formatter thread: format the entries of the next queued batch
+ */
+static void *formatter(void *arg) {
+    batch_t *batch;
+    int i, size;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (format_next == head) {
+            pthread_cond_wait(&can_format, &lock);
+        }
+        batch = ring + (format_next++ % ring_size);
+        pthread_mutex_unlock(&lock);
+
+        /*
+         * The output buffer only grows as big as the batches get, one
+         * more record for REC_CLOSE
+         */
+        size = (batch->count + 1) * WRITE_LOG_REC_SIZE;
+        if (size > batch->out_size) {
+            free(batch->out);
+            if (!(batch->out = (char*) malloc(size))) {
+                DIE_ERROR(6, ZONE, "could not allocate batch output buffer");
+            }
+            batch->out_size = size;
+        }
+        batch->out_len = 0;
+        for (i = 0; i < batch->count; i++) {
+            batch->out_len += format_entry(batch->entries + i, batch->log_file,
+                                           batch->out + batch->out_len);
+        }
+
+        pthread_mutex_lock(&lock);
+        batch->state = BATCH_FORMATTED;
+        pthread_cond_broadcast(&can_write);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/*
+ * Writer thread: send the formatted batches to write_log, in order
+ */
+static void *writer(void *arg) {
+    batch_t *batch;
+    uint64_t now;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (tail == head
+               || ring[tail % ring_size].state != BATCH_FORMATTED) {
+            pthread_cond_wait(&can_write, &lock);
+        }
+        batch = ring + (tail % ring_size);
+        pthread_mutex_unlock(&lock);
+
+        write_batch(batch);
+        now = monotonic_ns();
+
+        pthread_mutex_lock(&lock);
+        if (batch->count) {
+            latency_total += now - batch->first_ns;
+            latency_count++;
+            if (now - batch->first_ns > latency_max) {
+                latency_max = now - batch->first_ns;
+            }
+            service_avg = service_avg
+                ? (service_avg * 7 + (now - batch->submit_ns)) / 8
+                : now - batch->submit_ns;
+        }
+        batch->state = BATCH_FILLING;
+        tail++;
+        pthread_cond_broadcast(&can_fill);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+batch_t *pipeline_start(int formatters, int depth, int memory, int p[2]) {
+    pthread_t thread;
+    long batch_memory;
+    int i;
+
+    /*
+     * A full batch, its entries and output buffer. At least two, one
+     * to fill and one in the works.
+     */
+    batch_memory = sizeof(batch_t) + (LOG_ENTRIES + 1) * WRITE_LOG_REC_SIZE;
+    if (depth * batch_memory > memory * 1048576L) {
+        depth = memory * 1048576L / batch_memory;
+        if (depth < 2) {
+            depth = 2;
+        }
+        LOG_PRINTF(DEBUG_MIN, ZONE, "pipeline: queue depth cut to %d "
+                   "batches (%d MB)", depth, memory);
+    }
+
+    write_log = p;
+    ring_size = depth;
+    formatter_count = formatters;
+    if (!(ring = (batch_t*) calloc(depth, sizeof(batch_t)))) {
+        DIE_ERROR(6, ZONE, "could not allocate %d batches", depth);
+    }
+
+    tzset(); /* mk_timestamp() uses localtime_r() */
+
+    for (i = 0; i < formatters; i++) {
+        if (pthread_create(&thread, NULL, formatter, NULL)) {
+            DIE_ERROR(6, ZONE, "pthread_create(formatter): %s", LAST_ERROR);
+        }
+        pthread_detach(thread);
+    }
+    if (pthread_create(&thread, NULL, writer, NULL)) {
+        DIE_ERROR(6, ZONE, "pthread_create(writer): %s", LAST_ERROR);
+    }
+    pthread_detach(thread);
+
+    LOG_PRINTF(DEBUG_MIN, ZONE, "pipeline: %d formatters, %d batches",
+               formatters, depth);
+    return ring;
+}
+
+batch_t *pipeline_submit(batch_t *batch) {
+    unsigned long depth;
+
+    pthread_mutex_lock(&lock);
+    entries += batch->count;
+    batch->submit_ns = monotonic_ns();
+    batch->state = BATCH_QUEUED;
+    head++;
+    depth = head - tail;
+    if (depth > max_depth) {
+        max_depth = depth;
+    }
+    pthread_cond_signal(&can_format);
+
+    /*
+     * wait for the next batch in the ring to be written
+     */
+    if (head - tail == ring_size) {
+        stalls++;
+        LOG_PRINTF(DEBUG_MED, ZONE, "pipeline: all %d batches busy, waiting",
+                   ring_size);
+        while (head - tail == ring_size) {
+            pthread_cond_wait(&can_fill, &lock);
+        }
+    }
+    batch = ring + (head % ring_size);
+    pthread_mutex_unlock(&lock);
+
+    batch->count = 0;
+    batch->close.log_file[0] = '\0';
+    batch->first_ns = 0;
+    return batch;
+}
+
+void pipeline_drain(void) {
+    pthread_mutex_lock(&lock);
+    while (tail != head) {
+        pthread_cond_wait(&can_fill, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+uint64_t pipeline_service_time(void) {
+    uint64_t result;
+
+    pthread_mutex_lock(&lock);
+    result = service_avg;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void pipeline_stats(void) {
+    pthread_mutex_lock(&lock);
+    LOG_PRINTF(0, ZONE, "Stats: pipeline: %lu batches, %lu entries, "
+               "%lu queued, %lu in progress, max depth %lu/%d, %lu stalls, "
+               "%d formatters", head, entries, head - format_next,
+               format_next - tail, max_depth, ring_size, stalls,
+               formatter_count);
+    if (latency_count) {
+        LOG_PRINTF(0, ZONE, "Stats: pipeline: flush latency avg %.1f ms, "
+                   "max %.1f ms, %.1f ms in pipeline",
+                   latency_total / 1e6 / latency_count, latency_max / 1e6,
+                   service_avg / 1e6);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Batch pipeline definitions. The receiver fills batches of log entries,
+ * formatter threads turn them into write_log messages and a writer thread
+ * sends them to the write_log process, in the order they were received.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <time.h>
+#include <stdint.h>
+#include "logger.h"
+
+/*
+ * Number of formatter threads and of batches in flight (per worker).
+ * These defaults can be overridden on command line.
+ */
+#ifndef FORMAT_THREADS
+#define FORMAT_THREADS 2
+#endif
+#ifndef PIPELINE_DEPTH
+#define PIPELINE_DEPTH 16
+#endif
+/*
+ * Memory for the batches of one worker, MB (--pipeline-memory). A batch
+ * is its entries, sizeof(batch_t) or about 2.2 MB with LOG_ENTRIES at
+ * 1024, plus its output buffer, grown to the batch size actually used
+ * and up to about as much again. The queue depth is cut down to what
+ * fits, so this times --workers bounds the resident size of the batches.
+ */
+#ifndef PIPELINE_MEMORY
+#define PIPELINE_MEMORY 32
+#endif
+
+typedef struct {
+    log_entry entries[LOG_ENTRIES];
+    int count;                  /* number of entries used                  */
+    close_rec close;            /* if close.log_file[0], send a REC_CLOSE  */
+    char log_file[32];          /* log file name when batch was submitted  */
+    uint64_t first_ns;          /* when the first entry was received       */
+    uint64_t submit_ns;         /* when the batch was submitted            */
+    char *out;                  /* formatted messages for write_log        */
+    int out_len;
+    int out_size;               /* allocated for out, see formatter()      */
+    int state;                  /* (internal) see pipeline.c               */
+} batch_t;
+
+/*
+ * Monotonic clock in nanoseconds, for the latency measurements
+ */
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Allocate the batches and start the threads. There are depth batches,
+ * or fewer if they don't fit in memory MB. Frames are sent to the
+ * write_log socket pair p. Returns the first batch to fill.
+ */
+batch_t *pipeline_start(int formatters, int depth, int memory, int p[2]);
+/*
+ * Queue a filled batch for processing and return the next one to fill.
+ * Blocks if all the batches are still being processed.
+ */
+batch_t *pipeline_submit(batch_t *batch);
+/*
+ * Wait until all the submitted batches have been written.
+ */
+void pipeline_drain(void);
+/*
+ * Average time (ns) from submit until a batch is written, that is the
+ * part of the flush latency spent in the pipeline.
+ */
+uint64_t pipeline_service_time(void);
+/*
+ * Log the queue depth counters and the achieved flush latency
+ */
+void pipeline_stats(void);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Separator scanner for log lines. The vector versions compare 16 (SSE2)
+ * or 32 (AVX2) bytes at a time with the separator and walk the bits of
+ * the resulting mask, so long user agents and referrers cost a few
+ * instructions per block instead of a compare per byte. The AVX2 version
+ * is picked at run time if the CPU supports it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+static const char *VERSION __attribute__ ((used)) = "$Id$";
+
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#include <immintrin.h>
+#define SCAN_SSE2
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_AVX2
+#endif
+#endif
+
+/*
+ * Byte at a time, from offset start. Also finishes the tail of the
+ * vector versions.
+ */
+static int scan_scalar(const char *buf, int start, int length, char sep,
+                       int *pos, int max) {
+    int i, n = 0;
+
+    for (i = start; i < length && n < max; i++) {
+        if (buf[i] == sep) {
+            pos[n++] = i;
+        }
+    }
+    return n;
+}
+
+#ifdef SCAN_SSE2
+static int scan_sse2(const char *buf, int length, char sep, int *pos, int max) {
+    __m128i needle = _mm_set1_epi8(sep);
+    unsigned mask;
+    int i, n = 0;
+
+    for (i = 0; i + 16 <= length; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+                   _mm_loadu_si128((const __m128i*) (buf + i))));
+        while (mask) {
+            if (n >= max) {
+                return n;
+            }
+            pos[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + scan_scalar(buf, i, length, sep, pos + n, max - n);
+}
+#endif
+
+#ifdef SCAN_AVX2
+__attribute__ ((target("avx2")))
+static int scan_avx2(const char *buf, int length, char sep, int *pos, int max) {
+    __m256i needle = _mm256_set1_epi8(sep);
+    unsigned mask;
+    int i, n = 0;
+
+    for (i = 0; i + 32 <= length; i += 32) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle,
+                   _mm256_loadu_si256((const __m256i*) (buf + i))));
+        while (mask) {
+            if (n >= max) {
+                return n;
+            }
+            pos[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + scan_scalar(buf, i, length, sep, pos + n, max - n);
+}
+#endif
+
+static int scan_default(const char *buf, int length, char sep,
+                        int *pos, int max) {
+    return scan_scalar(buf, 0, length, sep, pos, max);
+}
+
+static int (*scanner)(const char*, int, char, int*, int) = scan_default;
+static const char *scanner_name = "scalar";
+
+/*
+ * Pick the scanner for this CPU, once before main() so that the threads
+ * only ever read it
+ */
+__attribute__ ((constructor))
+static void scan_init(void) {
+#ifdef SCAN_SSE2
+    scanner = scan_sse2;
+    scanner_name = "sse2";
+#endif
+#ifdef SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanner = scan_avx2;
+        scanner_name = "avx2";
+    }
+#endif
+}
+
+int scan_sep(const char *buf, int length, char sep, int *pos, int max) {
+    return scanner(buf, length, sep, pos, max);
+}
+
+const char *scan_impl(void) {
+    return scanner_name;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Fast scanning of log lines: finding the field separators (SSE2/AVX2
+ * when available) and parsing the numeric fields.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+/*
+ * Find the offsets of (at most max) occurrences of sep in the first
+ * length bytes of buf and store them in pos. Returns how many were found.
+ * Uses the widest vector instructions the CPU has.
+ */
+int scan_sep(const char *buf, int length, char sep, int *pos, int max);
+
+/*
+ * Name of the scanner in use ("avx2", "sse2" or "scalar")
+ */
+const char *scan_impl(void);
+
+/*
+ * Parse the decimal number at p (at most len digits), stops at the
+ * first non-digit. Like atoi() without the sign and the whitespace.
+ */
+static inline unsigned parse_uint(const char *p, int len) {
+    unsigned n = 0;
+
+    for (; len > 0 && (unsigned) (*p - '0') < 10; p++, len--) {
+        n = n * 10 + (*p - '0');
+    }
+    return n;
+}
+
+/*
+ * Parse an HTTP status; the 3 digit case is done without a loop
+ */
+static inline unsigned parse_status(const char *p, int len) {
+    if (len == 3 && (unsigned) (p[0] - '0') < 10
+        && (unsigned) (p[1] - '0') < 10 && (unsigned) (p[2] - '0') < 10) {
+        return (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+    }
+    return parse_uint(p, len);
+}
+
+/*
+ * Parse a byte count, where "-" (no body) is returned as -1
+ */
+static inline unsigned parse_bytes(const char *p, int len) {
+    return (len > 0 && *p == '-') ? (unsigned) -1 : parse_uint(p, len);
+}
+
+#endif
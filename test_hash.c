@@ -0,0 +1,251 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * make check: the hash finds, replaces and deletes keys, also while a
+ * resize is moving them to the new table, and every key is still there
+ * after the table has grown a few times. Includes hash.c to see when a
+ * resize is under way.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.c"
+
+#define KEYS 20000
+
+static char present[KEYS];
+static int failed, tests;
+
+#define FAIL(...) do { printf("FAIL " __VA_ARGS__); printf("\n"); \
+                       failed++; } while (0)
+
+static const char *key(int i) {
+    static char buf[64];
+
+    snprintf(buf, sizeof(buf), "www%d.example.com", i);
+    return buf;
+}
+
+/*
+ * The hash frees the values, so every one is malloc()ed
+ */
+static int *value(int i) {
+    int *v = (int*) malloc(sizeof(int));
+
+    *v = i;
+    return v;
+}
+
+static int resizing(hash_t *hash) {
+    return ((hash_data*) hash->data)->old.slots != NULL;
+}
+
+static void insert(hash_t *hash, int i) {
+    if (!hash_insert(hash, key(i), value(i))) {
+        FAIL("%s could not be inserted", key(i));
+        return;
+    }
+    present[i] = 1;
+}
+
+static void delete(hash_t *hash, int i) {
+    if (hash_delete(hash, key(i)) != present[i]) {
+        FAIL("deleting %s returned %d", key(i), !present[i]);
+    }
+    present[i] = 0;
+}
+
+/*
+ * Every key of the first n is found with its value, or not at all if it
+ * was deleted, and the count adds up
+ */
+static void check(hash_t *hash, const char *what, int n) {
+    int i, *v, count = 0;
+
+    tests++;
+    for (i = 0; i < n; i++) {
+        v = (int*) hash_get(hash, key(i));
+        if (present[i] && (!v || *v != i)) {
+            FAIL("%s: %s is %d, want %d", what, key(i), v ? *v : -1, i);
+            return;
+        }
+        if (!present[i] && v) {
+            FAIL("%s: deleted %s is still there", what, key(i));
+            return;
+        }
+        count += present[i];
+    }
+    if ((int) hash->count != count) {
+        FAIL("%s: count is %u, want %d", what, hash->count, count);
+    }
+}
+
+static void check_basic(void) {
+    hash_t *hash = hash_new(0);
+    int *v;
+
+    tests += 6;
+    if (hash_get(hash, "a")) {
+        FAIL("key found in an empty hash");
+    }
+    hash_insert(hash, "a", value(1));
+    hash_insert(hash, "", value(2));
+    if (!(v = (int*) hash_get(hash, "a")) || *v != 1
+        || !(v = (int*) hash_get(hash, "")) || *v != 2) {
+        FAIL("inserted keys not found");
+    }
+    if (hash_get(hash, "b") || hash_get(hash, "aa")) {
+        FAIL("key that was never inserted found");
+    }
+
+    /* replace: same count, the new value */
+    hash_insert(hash, "a", value(3));
+    if (!(v = (int*) hash_get(hash, "a")) || *v != 3 || hash->count != 2) {
+        FAIL("replaced key is %d, count %u", v ? *v : -1, hash->count);
+    }
+
+    if (!hash_delete(hash, "a") || hash_get(hash, "a") || hash->count != 1) {
+        FAIL("deleted key still there");
+    }
+    if (hash_delete(hash, "a") || hash_delete(hash, "b")) {
+        FAIL("deleted a key that is not there");
+    }
+    hash_destroy(hash);
+}
+
+/*
+ * Replace and delete keys while a resize is under way, both the ones that
+ * were moved to the new table and the ones still in the old one
+ */
+static void check_migration(void) {
+    hash_t *hash = hash_new(0);
+    hash_data *data;
+    unsigned int length, hashed;
+    int i, n, old, moved;
+
+    memset(present, 0, sizeof(present));
+    for (n = 0; !resizing(hash); n++) {
+        insert(hash, n);
+    }
+    tests++;
+    if (hash->size < 2 * n) {
+        FAIL("resizing %d keys to %u slots", n, hash->size);
+    }
+
+    /*
+     * Delete every third key and replace the ones after them, until the
+     * resize is over (check() would finish it)
+     */
+    for (i = 0, old = moved = 0; i + 1 < n && resizing(hash); i += 3) {
+        data = (hash_data*) hash->data;
+        hashed = hash_key(key(i), &length);
+        if (table_find(&data->old, key(i), length, hashed)) {
+            old++;
+        } else {
+            moved++;
+        }
+        delete(hash, i);
+        insert(hash, i + 1);
+    }
+    tests++;
+    if (!old || !moved) {
+        FAIL("%d deleted from the old table, %d from the new one", old, moved);
+    }
+    check(hash, "deleted while resizing", n);
+
+    while (resizing(hash)) {
+        hash_get(hash, key(0));
+    }
+    check(hash, "resize done", n);
+
+    /* deleted keys inserted again */
+    for (i = 0; i < n; i++) {
+        if (!present[i]) {
+            insert(hash, i);
+        }
+    }
+    check(hash, "inserted again", n);
+    hash_destroy(hash);
+}
+
+/*
+ * Grow from the smallest table to KEYS keys, deleting a few on the way,
+ * then delete and insert until the arena is compacted
+ */
+static void check_growth(void) {
+    hash_t *hash = hash_new(1);
+    unsigned int size = hash->size;
+    int i, resizes = 0;
+
+    memset(present, 0, sizeof(present));
+    for (i = 0; i < KEYS; i++) {
+        insert(hash, i);
+        if (i % 7 == 3) {
+            delete(hash, i - 2);
+        }
+        if (hash->size != size) {
+            size = hash->size;
+            resizes++;
+            check(hash, "after a resize", i + 1);
+        }
+    }
+    tests++;
+    if (resizes < 5) {
+        FAIL("%d resizes for %d keys", resizes, KEYS);
+    }
+    check(hash, "all inserted", KEYS);
+
+    for (i = 0; i < KEYS; i += 2) {
+        delete(hash, i);
+    }
+    check(hash, "half deleted", KEYS);
+
+    /* the same keys over and over, the arena fills with deleted ones */
+    for (i = 0; i < 20 * KEYS; i++) {
+        delete(hash, i % KEYS);
+        insert(hash, (i + KEYS / 2) % KEYS);
+    }
+    while (resizing(hash)) {
+        hash_get(hash, key(0));
+    }
+    tests++;
+    if (((hash_data*) hash->data)->arena.bytes
+        > 2 * ((hash_data*) hash->data)->arena.live + 2 * ARENA_BLOCK) {
+        FAIL("arena has %zu bytes for %zu bytes of keys",
+             ((hash_data*) hash->data)->arena.bytes,
+             ((hash_data*) hash->data)->arena.live);
+    }
+    check(hash, "arena compacted", KEYS);
+    hash_destroy(hash);
+}
+
+int main(int argc, char **argv) {
+    check_basic();
+    check_migration();
+    check_growth();
+
+    printf("hash: %d tests, %d failures\n", tests, failed);
+    return failed ? 1 : 0;
+}
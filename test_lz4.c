@@ -0,0 +1,214 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * make check: LZ4 compression round trips, and decompression of broken
+ * input fails without writing past the output buffer.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+
+#define CANARY 0x5a
+#define GUARD  64
+
+static char src[LZ4_MAX_INPUT + 1];
+static char packed[LZ4_BOUND(LZ4_MAX_INPUT) + GUARD];
+static char plain[LZ4_MAX_INPUT + GUARD];
+static char good[LZ4_BOUND(1400)];
+static int failed, tests;
+
+#define FAIL(...) do { printf("FAIL " __VA_ARGS__); printf("\n"); \
+                       failed++; } while (0)
+
+/*
+ * Whether the GUARD bytes after the first size of buf are untouched
+ */
+static int guarded(const char *buf, int size) {
+    int i;
+
+    for (i = size; i < size + GUARD; i++) {
+        if (buf[i] != CANARY) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Compress length bytes of src, decompress them and compare. Also try
+ * output buffers one byte too small for either. Returns the compressed
+ * length.
+ */
+static int round_trip(const char *what, int length) {
+    int size, n;
+
+    tests++;
+    memset(packed, CANARY, sizeof(packed));
+    size = lz4_compress(src, length, packed, LZ4_BOUND(length));
+    if (size < 0 || size > LZ4_BOUND(length)
+        || !guarded(packed, LZ4_BOUND(length))) {
+        FAIL("%s: compress returned %d for %d bytes", what, size, length);
+        return -1;
+    }
+    memset(plain, CANARY, sizeof(plain));
+    n = lz4_decompress(packed, size, plain, length);
+    if (n != length || memcmp(plain, src, length) || !guarded(plain, length)) {
+        FAIL("%s: decompress returned %d, want %d", what, n, length);
+        return -1;
+    }
+
+    memset(packed + size - 1, CANARY, GUARD + 1);
+    if (lz4_compress(src, length, packed, size - 1) != -1
+        || !guarded(packed, size - 1)) {
+        FAIL("%s: compress into %d bytes did not fail cleanly", what, size - 1);
+    }
+    lz4_compress(src, length, packed, size);
+    if (length > 0) {
+        memset(plain, CANARY, sizeof(plain));
+        if (lz4_decompress(packed, size, plain, length - 1) != -1
+            || !guarded(plain, length - 1)) {
+            FAIL("%s: decompress into %d bytes did not fail cleanly",
+                 what, length - 1);
+        }
+    }
+    return size;
+}
+
+/*
+ * Decompress broken input into a buffer of size bytes; it has to fail,
+ * or at least stay within the buffer
+ */
+static void broken(const char *what, const char *in, int length, int size,
+                   int must_fail) {
+    int n;
+
+    tests++;
+    memset(plain, CANARY, sizeof(plain));
+    n = lz4_decompress(in, length, plain, size);
+    if ((must_fail && n != -1) || n < -1 || n > size || !guarded(plain, size)) {
+        FAIL("%s: decompress returned %d (room for %d)", what, n, size);
+    }
+}
+
+static const struct {
+    const char *what;
+    const char *data;
+    int length;
+} invalid[] = {
+    { "empty input",            "", 0 },
+    { "literals past the end",  "\x50" "abc", 4 },
+    { "long literals, no end",  "\xf0\xff\xff", 3 },
+    { "half an offset",         "\x14" "a\x01", 3 },
+    { "offset 0",               "\x14" "a\x00\x00", 4 },
+    { "offset before start",    "\x14" "a\x02\x00", 4 },
+    { "long match, no end",     "\x1f" "a\x01\x00\xff", 5 },
+    { "match past the output",  "\x1f" "a\x01\x00\xff\xff\x10", 7 },
+};
+
+static const char *lines =
+    "10.0.0.1\t-\t-\t200\t512\twww.example.com\tGET /index.html HTTP/1.1\t"
+    "http://www.example.com/\tMozilla/5.0 (X11; Linux x86_64)\n"
+    "10.0.0.2\t-\t-\t304\t-\twww.example.com\tGET /style.css HTTP/1.1\t"
+    "http://www.example.com/index.html\tMozilla/5.0 (X11; Linux x86_64)\n";
+
+int main(int argc, char **argv) {
+    char what[64];
+    int i, j, length, size;
+
+    /*
+     * Round trips: short, repetitive, incompressible, lengths that need
+     * the extra length bytes, and the largest input
+     */
+    round_trip("empty", 0);
+    strcpy(src, "a");
+    round_trip("one byte", 1);
+    for (length = 0; length < 8192; length += strlen(lines)) {
+        strcpy(src + length, lines);
+    }
+    for (length = 1; length <= 300; length++) {
+        snprintf(what, sizeof(what), "log lines, %d bytes", length);
+        round_trip(what, length);
+    }
+    round_trip("log lines, 8 KB", 8192);
+    memset(src, 'x', LZ4_MAX_INPUT);
+    round_trip("one byte repeated", 1000);
+    round_trip("one byte repeated, largest input", LZ4_MAX_INPUT);
+    srandom(1);
+    for (i = 0; i < LZ4_MAX_INPUT; i++) {
+        src[i] = random();
+    }
+    round_trip("random, 15 bytes", 15);
+    round_trip("random, 270 bytes", 270);
+    round_trip("random, largest input", LZ4_MAX_INPUT);
+    for (i = 0; i < LZ4_MAX_INPUT; i++) {
+        src[i] = "abcd"[random() % 4];
+    }
+    round_trip("four letters, largest input", LZ4_MAX_INPUT);
+    tests++;
+    if (lz4_compress(src, LZ4_MAX_INPUT + 1, packed, sizeof(packed)) != -1) {
+        FAIL("compressed more than LZ4_MAX_INPUT");
+    }
+
+    for (i = 0; i < (int) (sizeof(invalid) / sizeof(invalid[0])); i++) {
+        broken(invalid[i].what, invalid[i].data, invalid[i].length, 64, 1);
+    }
+
+    /*
+     * Every truncation and every bit flip of a compressed datagram
+     */
+    for (length = 0; length < 1400; length += strlen(lines)) {
+        strcpy(src + length, lines);
+    }
+    size = lz4_compress(src, 1400, good, LZ4_BOUND(1400));
+    for (i = 0; i < size; i++) {
+        /* cut right after some literals, it is a shorter valid input */
+        snprintf(what, sizeof(what), "truncated to %d bytes", i);
+        broken(what, good, i, 1400, 0);
+        length = lz4_decompress(good, i, plain, 1400);
+        if (length >= 1400 || (length > 0 && memcmp(plain, src, length))) {
+            FAIL("%s: decompressed to %d bytes, not a part of the input",
+                 what, length);
+        }
+    }
+    for (i = 0; i < size; i++) {
+        for (j = 0; j < 8; j++) {
+            memcpy(packed, good, size);
+            packed[i] ^= 1 << j;
+            snprintf(what, sizeof(what), "bit %d of byte %d flipped", j, i);
+            broken(what, packed, size, 1400, 0);
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        for (j = 0; j < 64; j++) {
+            packed[j] = random();
+        }
+        snprintf(what, sizeof(what), "random input %d", i);
+        broken(what, packed, 1 + random() % 64, 256, 0);
+    }
+
+    printf("lz4: %d tests, %d failures\n", tests, failed);
+    return failed ? 1 : 0;
+}
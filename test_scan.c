@@ -0,0 +1,163 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * make check: every scanner this CPU can run gives the same positions
+ * as a plain loop, and none of them stores more than max of them.
+ * Includes scan.c to get at the scanners that scan_sep() didn't pick.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.c"
+
+#define MAX_POS 256
+#define CANARY  -7
+
+typedef struct {
+    const char *name;
+    int (*scan)(const char*, int, char, int*, int);
+} scanner_t;
+
+static scanner_t scanners[4];
+static int scanner_count;
+
+static const struct {
+    const char *buf;
+    char sep;
+} cases[] = {
+    { "", '\t' },
+    { "no separator here", '\t' },
+    { "\t", '\t' },
+    { "a\tb", '\t' },
+    { "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t", '\t' },          /* 16 */
+    { "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t", '\t' },        /* 17 */
+    { "10.0.0.1\t-\t-\t200\t512\twww.example.com\tGET / HTTP/1.1"
+      "\thttp://referer/\tMozilla/5.0 (X11; Linux x86_64)", '\t' },
+    { "0123456789abcde\t0123456789abcdef0123456789abcde\t", '\t' },
+    { "line one\nline two\nline three\n\n", '\n' },
+    { "x\xff" "y\xff\xff" "z", '\xff' },                       /* sign bit */
+};
+
+/*
+ * Compare every scanner with the plain loop on buf, for max around
+ * the number of separators (0 included) and the whole pos array.
+ */
+static int check(const char *what, const char *buf, int length, char sep) {
+    int want[MAX_POS], pos[MAX_POS + 1];
+    int maxes[] = { 0, 1, 2, 0, 0, 0, MAX_POS };
+    int i, j, k, m, n, found = 0, failed = 0;
+
+    for (i = 0; i < length && found < MAX_POS; i++) {
+        if (buf[i] == sep) {
+            want[found++] = i;
+        }
+    }
+    maxes[3] = found > 0 ? found - 1 : 0;
+    maxes[4] = found;
+    maxes[5] = found + 1;
+
+    for (i = 0; i < scanner_count; i++) {
+        for (j = 0; j < (int) (sizeof(maxes) / sizeof(maxes[0])); j++) {
+            m = maxes[j];
+            for (k = 0; k <= MAX_POS; k++) {
+                pos[k] = CANARY;
+            }
+            n = scanners[i].scan(buf, length, sep, pos, m);
+            if (n != (found < m ? found : m)) {
+                printf("FAIL %s %s max %d: %d found, want %d\n",
+                       scanners[i].name, what, m, n, found < m ? found : m);
+                failed++;
+                continue;
+            }
+            for (k = 0; k < n; k++) {
+                if (pos[k] != want[k]) {
+                    printf("FAIL %s %s max %d: pos[%d] is %d, want %d\n",
+                           scanners[i].name, what, m, k, pos[k], want[k]);
+                    failed++;
+                    break;
+                }
+            }
+            if (pos[m] != CANARY) {
+                printf("FAIL %s %s max %d: stored past max\n",
+                       scanners[i].name, what, m);
+                failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    char buf[1024];
+    char what[64];
+    int i, j, length, failed = 0, tests = 0;
+
+    scanners[scanner_count].name = "scalar";
+    scanners[scanner_count++].scan = scan_default;
+#ifdef SCAN_SSE2
+    scanners[scanner_count].name = "sse2";
+    scanners[scanner_count++].scan = scan_sse2;
+#endif
+#ifdef SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanners[scanner_count].name = "avx2";
+        scanners[scanner_count++].scan = scan_avx2;
+    }
+#endif
+    scanners[scanner_count].name = scan_impl();
+    scanners[scanner_count++].scan = scan_sep;
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        snprintf(what, sizeof(what), "case %d", i);
+        failed += check(what, cases[i].buf, strlen(cases[i].buf), cases[i].sep);
+        tests++;
+    }
+
+    /*
+     * Every length across a few vector blocks, separators at random
+     * offsets, sparse and dense
+     */
+    srandom(1);
+    for (length = 0; length <= 100; length++) {
+        for (j = 1; j <= 8; j *= 2) {
+            for (i = 0; i < length; i++) {
+                buf[i] = (random() % (j * 2)) ? 'a' + i % 26 : '\t';
+            }
+            snprintf(what, sizeof(what), "length %d density 1/%d", length, j * 2);
+            failed += check(what, buf, length, '\t');
+            tests++;
+        }
+    }
+    /* a separator in the last byte of the buffer, after a full block */
+    memset(buf, 'a', sizeof(buf));
+    buf[sizeof(buf) - 1] = '\t';
+    failed += check("last byte", buf, sizeof(buf), '\t');
+    tests++;
+
+    printf("scan: %d buffers, %d scanners, %d failures\n",
+           tests, scanner_count, failed);
+    return failed ? 1 : 0;
+}
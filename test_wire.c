@@ -0,0 +1,307 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * make check: binary records (wire.h). Lines come back the same after
+ * encoding and decoding, the fields get the tags they should, and
+ * malformed records are rejected without reading past the datagram.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wire.h"
+
+#define DATAGRAM 8192
+
+static int failed, tests;
+
+#define FAIL(...) do { printf("FAIL " __VA_ARGS__); printf("\n"); \
+                       failed++; } while (0)
+
+/*
+ * Lines packed in one datagram, in order, so the later ones use
+ * references to the strings of the earlier ones
+ */
+static const char *lines[] = {
+    "10.0.0.1\t-\t-\t200\t512\twww.example.com\tGET / HTTP/1.1"
+    "\thttp://www.example.com/\tMozilla/5.0 (X11; Linux x86_64)",
+    "10.0.0.2\t-\tbob\t304\t-\twww.example.com\tGET /a.css HTTP/1.1"
+    "\thttp://www.example.com/\tMozilla/5.0 (X11; Linux x86_64)",
+    "::1\t-\t-\t404\t0\twww.example.com\tGET /x HTTP/1.0\t-\tcurl/8.0",
+    "2001:db8::8a2e:370:7334\t-\t-\t200\t4294967295\tv\tGET /y HTTP/1.1\t-\t-",
+    "010.0.0.1\t007\t-1\t+5\t4294967296\t2001:DB8::1\tabc\tabcd\tabcd",
+    "",
+    "-",
+    "\t\t",
+    "1.2.3.4.5\t1.2.3\t::1::\t:\t0\t00\t123456789\t1234567890",
+};
+
+/*
+ * The tag each kind of field should get
+ */
+static const struct {
+    const char *field;
+    int tag;
+} tags[] = {
+    { "-",                  WIRE_NONE },
+    { "0",                  WIRE_UINT },
+    { "200",                WIRE_UINT },
+    { "123456789",          WIRE_UINT },
+    { "1234567890",         WIRE_STR },     /* more than 9 digits  */
+    { "007",                WIRE_STR },     /* would print as 7    */
+    { "+5",                 WIRE_STR },
+    { "10.0.0.1",           WIRE_IPV4 },
+    { "255.255.255.255",    WIRE_IPV4 },
+    { "010.0.0.1",          WIRE_STR },     /* not how it prints   */
+    { "1.2.3",              WIRE_STR },
+    { "::1",                WIRE_IPV6 },
+    { "2001:db8::1",        WIRE_IPV6 },
+    { "2001:DB8::1",        WIRE_STR },     /* prints lowercase    */
+    { "",                   WIRE_STR },
+    { "www.example.com",    WIRE_STR },
+};
+
+/*
+ * Malformed records (after the datagram header) and how many values
+ * can be read before wire_next() fails
+ */
+static const struct {
+    const char *what;
+    const char *data;
+    int length;
+    int values;
+} invalid[] = {
+    { "unknown tag",            "\x01\x09", 2, 0 },
+    { "no value",               "\x01", 1, 0 },
+    { "number cut short",       "\x01\x01\x80", 3, 0 },
+    { "number over 32 bits",    "\x01\x01\xff\xff\xff\xff\x1f", 7, 0 },
+    { "number of 6 bytes",      "\x01\x01\x80\x80\x80\x80\x80\x00", 8, 0 },
+    { "IPv4 cut short",         "\x01\x02\x0a\x00\x00", 5, 0 },
+    { "IPv6 cut short",         "\x01\x03\x00\x00\x00\x00", 6, 0 },
+    { "string past the end",    "\x01\x04\x05" "abcd", 7, 0 },
+    { "string length cut short", "\x01\x04\x80", 3, 0 },
+    { "reference, no strings",  "\x02\x04\x02" "ab\x05\x00", 7, 1 },
+    { "reference ahead",        "\x02\x04\x04" "abcd\x05\x01", 9, 1 },
+    { "reference cut short",    "\x02\x04\x04" "abcd\x05", 8, 1 },
+};
+
+/*
+ * Decode the next record of r back into a line at out. Returns its
+ * length, or -1.
+ */
+static int decode_line(wire_reader *r, char *out, int size) {
+    wire_value v;
+    unsigned count, i;
+    int len, length = 0;
+
+    if (wire_get_uint(r, &count)) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (wire_next(r, &v)) {
+            return -1;
+        }
+        if (i && length < size) {
+            out[length++] = '\t';
+        }
+        if ((len = wire_text(&v, out + length, size - length)) < 0) {
+            return -1;
+        }
+        length += len;
+    }
+    return length;
+}
+
+static void check_round_trip(void) {
+    char datagram[DATAGRAM], line[DATAGRAM];
+    wire_dict dict;
+    wire_reader r;
+    int i, n, length = 0;
+
+    dict.count = 0;
+    for (i = 0; i < (int) (sizeof(lines) / sizeof(lines[0])); i++) {
+        n = wire_encode(&dict, lines[i], strlen(lines[i]), datagram + length,
+                        sizeof(datagram) - length);
+        if (n < 0) {
+            FAIL("could not encode line %d", i);
+            return;
+        }
+        length += n;
+    }
+    wire_start(&r, datagram, length);
+    for (i = 0; i < (int) (sizeof(lines) / sizeof(lines[0])); i++) {
+        tests++;
+        n = decode_line(&r, line, sizeof(line));
+        if (n < 0 || n != (int) strlen(lines[i]) || memcmp(line, lines[i], n)) {
+            FAIL("line %d came back as \"%.*s\"", i, n < 0 ? 0 : n, line);
+        }
+    }
+    tests++;
+    if (r.pos != r.end) {
+        FAIL("%d bytes left after the last record", (int) (r.end - r.pos));
+    }
+
+    /*
+     * Every truncation: the record cut fails and nothing is read past
+     * the end
+     */
+    for (n = 0; n < length; n++) {
+        tests++;
+        wire_start(&r, datagram, n);
+        for (i = 0; r.pos < r.end; i++) {
+            if (decode_line(&r, line, sizeof(line)) < 0) {
+                break;
+            }
+        }
+        if (r.pos > r.end) {
+            FAIL("truncated to %d bytes: read %d bytes past the end", n,
+                 (int) (r.pos - r.end));
+        }
+    }
+}
+
+static void check_tags(void) {
+    char out[64];
+    wire_dict dict;
+    wire_reader r;
+    wire_value v;
+    unsigned count;
+    int i, n;
+
+    for (i = 0; i < (int) (sizeof(tags) / sizeof(tags[0])); i++) {
+        tests++;
+        dict.count = 0;
+        n = wire_encode(&dict, tags[i].field, strlen(tags[i].field), out,
+                        sizeof(out));
+        wire_start(&r, out, n < 0 ? 0 : n);
+        if (n < 0 || wire_get_uint(&r, &count) || count != 1
+            || wire_next(&r, &v)) {
+            FAIL("\"%s\" could not be encoded", tags[i].field);
+            continue;
+        }
+        if (v.tag != tags[i].tag) {
+            FAIL("\"%s\" has tag %d, want %d", tags[i].field, v.tag,
+                 tags[i].tag);
+        }
+    }
+
+    /* a repeated string is a reference the second time */
+    tests++;
+    dict.count = 0;
+    n = wire_encode(&dict, "abcd\tabcd\tabc\tabc", 17, out, sizeof(out));
+    if (n != 1 + 2 * (2 + 4) + 2 * (2 + 3) - 4) {
+        FAIL("\"abcd abcd abc abc\" is %d bytes, want %d", n,
+             1 + 2 * (2 + 4) + 2 * (2 + 3) - 4);
+    }
+}
+
+static void check_limits(void) {
+    char line[2 * (WIRE_FIELDS + 1)], out[256], text[8];
+    wire_dict dict;
+    wire_value v;
+    int i, n;
+
+    /* WIRE_FIELDS fields fit, one more does not */
+    for (i = 0; i <= WIRE_FIELDS; i++) {
+        line[2 * i] = 'a';
+        line[2 * i + 1] = '\t';
+    }
+    tests += 2;
+    dict.count = 0;
+    if (wire_encode(&dict, line, 2 * WIRE_FIELDS - 1, out, sizeof(out)) < 0) {
+        FAIL("%d fields could not be encoded", WIRE_FIELDS);
+    }
+    if (wire_encode(&dict, line, 2 * WIRE_FIELDS + 1, out,
+                    sizeof(out)) >= 0) {
+        FAIL("%d fields were encoded", WIRE_FIELDS + 1);
+    }
+
+    /* no room: fails, and the strings of the line are not numbered */
+    tests += 2;
+    dict.count = 0;
+    n = wire_encode(&dict, lines[0], strlen(lines[0]), out, sizeof(out));
+    for (i = 0; i < n; i++) {
+        dict.count = 0;
+        if (wire_encode(&dict, lines[0], strlen(lines[0]), out, i) >= 0) {
+            FAIL("line encoded in %d bytes, needs %d", i, n);
+            break;
+        }
+    }
+    dict.count = 0;
+    wire_encode(&dict, lines[0], strlen(lines[0]), out, n / 2);
+    if (dict.count) {
+        FAIL("%d strings left numbered after a line that did not fit",
+             dict.count);
+    }
+
+    /* text that does not fit */
+    tests += 3;
+    v.tag = WIRE_STR;
+    v.str = "abcdefgh";
+    v.len = 8;
+    if (wire_text(&v, text, sizeof(text)) != -1) {
+        FAIL("8 byte string fit in 8 bytes");
+    }
+    v.tag = WIRE_UINT;
+    v.number = 4294967295U;
+    if (wire_text(&v, text, sizeof(text)) != -1) {
+        FAIL("10 digits fit in 8 bytes");
+    }
+    v.tag = WIRE_NONE;
+    if (wire_text(&v, text, 1) != -1) {
+        FAIL("\"-\" fit in 1 byte");
+    }
+}
+
+static void check_invalid(void) {
+    wire_reader r;
+    wire_value v;
+    unsigned count;
+    int i, n;
+
+    for (i = 0; i < (int) (sizeof(invalid) / sizeof(invalid[0])); i++) {
+        tests++;
+        wire_start(&r, invalid[i].data, invalid[i].length);
+        if (wire_get_uint(&r, &count)) {
+            FAIL("%s: no field count", invalid[i].what);
+            continue;
+        }
+        for (n = 0; n < (int) count && !wire_next(&r, &v); n++)
+            ;
+        if (n != invalid[i].values || r.pos > r.end) {
+            FAIL("%s: %d values read, want %d", invalid[i].what, n,
+                 invalid[i].values);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    check_round_trip();
+    check_tags();
+    check_limits();
+    check_invalid();
+
+    printf("wire: %d tests, %d failures\n", tests, failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * io_uring write engine, on the raw system calls (no liburing).
+ *
+ * The writes of a frame are put in the submission queue and handed to
+ * the kernel with a single io_uring_enter(), which also waits for them.
+ * The kernel runs the writes to different files in parallel, so a slow
+ * file does not hold up the others.
+ *
+ * Two writes to the same file could complete out of order, so there is
+ * never more than one in flight per descriptor: a second write to a file
+ * first flushes the queue.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+static const char *VERSION __attribute__ ((used)) = "$Id$";
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+#include "debug.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+/* counters */
+static unsigned long writes, buffers, submits, sync_writes, short_writes;
+static unsigned long errors;
+
+/*
+ * Write everything, the way it was done before io_uring
+ */
+static void write_all(int fd, const char *buf, unsigned len) {
+    int written;
+
+    while (len) {
+        if ((written = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errors++;
+            LOG_PRINTF(DEBUG_MIN, ZONE, "write(%d, %u): %s", fd, len, LAST_ERROR);
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+/*
+ * Write everything in iov, skipping the first done bytes
+ */
+static void writev_all(int fd, const struct iovec *iov, int count,
+                       unsigned done) {
+    struct iovec rest[IOV_MAX];
+    int n, written;
+
+    while (count) {
+        for (; count && done >= iov->iov_len; iov++, count--) {
+            done -= iov->iov_len;
+        }
+        if (!count) {
+            return;
+        }
+        n = (count < IOV_MAX) ? count : IOV_MAX;
+        memcpy(rest, iov, n * sizeof(struct iovec));
+        rest[0].iov_base = (char*) rest[0].iov_base + done;
+        rest[0].iov_len -= done;
+        if ((written = writev(fd, rest, n)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errors++;
+            LOG_PRINTF(DEBUG_MIN, ZONE, "writev(%d, %d): %s", fd, n,
+                       LAST_ERROR);
+            return;
+        }
+        done += written;
+    }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static int ring_fd = -1;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+
+/*
+ * Requests in the ring, by user_data. The slots are reused after
+ * uring_flush(), when nothing is in flight.
+ */
+typedef struct {
+    int fd;
+    const char *buf;            /* or the iovec array, for count > 0 */
+    unsigned len;
+    int count;
+} uring_req;
+
+static uring_req *reqs;
+static unsigned used;           /* slots of reqs in use           */
+static unsigned queued;         /* not yet submitted to the kernel */
+static unsigned char *pending;  /* pending[fd]: fd has a write in the ring */
+static int pending_size;
+
+int uring_init(unsigned entries) {
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+    size_t sq_size, cq_size;
+
+    memset(&params, 0, sizeof(params));
+    if ((ring_fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "io_uring_setup(): %s", LAST_ERROR);
+        return -1;
+    }
+    /*
+     * Appending with offset -1 needs IORING_FEAT_RW_CUR_POS (Linux 5.6)
+     */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "io_uring is too old (features %x)",
+                   params.features);
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    sq_ring = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        LOG_PRINTF(DEBUG_MIN, ZONE, "mmap(io_uring): %s", LAST_ERROR);
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    cq_ring = sq_ring; /* IORING_FEAT_SINGLE_MMAP */
+
+    sq_head = (unsigned*) (sq_ring + params.sq_off.head);
+    sq_tail = (unsigned*) (sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned*) (sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned*) (sq_ring + params.sq_off.array);
+    cq_head = (unsigned*) (cq_ring + params.cq_off.head);
+    cq_tail = (unsigned*) (cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned*) (cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+
+    pending_size = getdtablesize();
+    reqs = (uring_req*) calloc(sq_entries, sizeof(uring_req));
+    pending = (unsigned char*) calloc(pending_size, 1);
+    if (!reqs || !pending) {
+        DIE_ERROR(6, ZONE, "could not allocate io_uring requests");
+    }
+
+    LOG_PRINTF(DEBUG_MIN, ZONE, "io_uring: %u entries", sq_entries);
+    return 0;
+}
+
+/*
+ * Look at the completions
+ */
+static unsigned reap(void) {
+    unsigned head = *cq_head, count = 0;
+    struct io_uring_cqe *cqe;
+    uring_req *req;
+
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = cqes + (head & *cq_mask);
+        req = reqs + cqe->user_data;
+        if (cqe->res < 0) {
+            errors++;
+            LOG_PRINTF(DEBUG_MIN, ZONE, "io_uring write(%d, %u): %s",
+                       req->fd, req->len, strerror(-cqe->res));
+        } else if ((unsigned) cqe->res < req->len) {
+            /* finish it the old way */
+            short_writes++;
+            if (req->count) {
+                writev_all(req->fd, (const struct iovec*) req->buf,
+                           req->count, cqe->res);
+            } else {
+                write_all(req->fd, req->buf + cqe->res, req->len - cqe->res);
+            }
+        }
+        head++;
+        count++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+/*
+ * Queue a write (count == 0) or writev (count buffers in buf)
+ */
+static void queue(int fd, const char *buf, unsigned len, int count) {
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+
+    /*
+     * One write in flight per descriptor, so that lines stay in order
+     */
+    if (fd >= pending_size || pending[fd] || used == sq_entries) {
+        uring_flush();
+    }
+
+    tail = *sq_tail;
+    index = tail & *sq_mask;
+    sqe = sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = count ? IORING_OP_WRITEV : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = count ? count : len;
+    sqe->off = (__u64) -1; /* current position, the end with O_APPEND */
+    sqe->user_data = used;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    reqs[used].fd = fd;
+    reqs[used].buf = buf;
+    reqs[used].len = len;
+    reqs[used].count = count;
+    used++;
+    queued++;
+    if (fd < pending_size) {
+        pending[fd] = 1;
+    }
+}
+
+void uring_write(int fd, const char *buf, unsigned len) {
+    writes++;
+    buffers++;
+    if (ring_fd < 0) {
+        sync_writes++;
+        write_all(fd, buf, len);
+        return;
+    }
+    queue(fd, buf, len, 0);
+}
+
+void uring_writev(int fd, const struct iovec *iov, int count, unsigned len) {
+    writes++;
+    buffers += count;
+    if (ring_fd < 0 || count > IOV_MAX) {
+        sync_writes++;
+        writev_all(fd, iov, count, 0);
+        return;
+    }
+    queue(fd, (const char*) iov, len, count);
+}
+
+void uring_flush(void) {
+    unsigned done = 0;
+    int result;
+
+    if (ring_fd < 0 || !used) {
+        return;
+    }
+    submits++;
+    while (done < used) {
+        result = syscall(__NR_io_uring_enter, ring_fd, queued, used - done,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                done += reap();
+                continue;
+            }
+            DIE_ERROR(1, ZONE, "io_uring_enter(): %s", LAST_ERROR);
+        }
+        queued -= result;
+        done += reap();
+    }
+    for (done = 0; done < used; done++) {
+        if (reqs[done].fd < pending_size) {
+            pending[reqs[done].fd] = 0;
+        }
+    }
+    used = 0;
+}
+
+#else /* no io_uring */
+
+int uring_init(unsigned entries) {
+    return -1;
+}
+
+void uring_write(int fd, const char *buf, unsigned len) {
+    writes++;
+    buffers++;
+    sync_writes++;
+    write_all(fd, buf, len);
+}
+
+void uring_writev(int fd, const struct iovec *iov, int count, unsigned len) {
+    writes++;
+    buffers += count;
+    sync_writes++;
+    writev_all(fd, iov, count, 0);
+}
+
+void uring_flush(void) {
+}
+
+#endif
+
+void uring_stats(void) {
+    LOG_PRINTF(0, ZONE, "Stats: write_log: %lu writes (%lu buffers), "
+               "%lu io_uring submits, %lu write() calls, %lu short writes, "
+               "%lu errors", writes, buffers, submits, sync_writes,
+               short_writes, errors);
+}
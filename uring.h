@@ -0,0 +1,72 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * io_uring write engine for the write_log process. Writes are queued
+ * and submitted together, one io_uring_enter() per frame; without
+ * io_uring they are plain write() calls.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/uio.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* UIO_MAXIOV */
+#endif
+
+/*
+ * Size of the submission queue, that is how many writes can be in flight
+ */
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256
+#endif
+
+/*
+ * Set up the ring. Returns 0 on success, -1 if io_uring cannot be used
+ * (then all the writes are done with write()).
+ */
+int uring_init(unsigned entries);
+/*
+ * Queue a write of len bytes at buf to the end of fd. The buffer has to
+ * stay valid until uring_flush(). Writes to the same fd are done in
+ * the order they were queued.
+ */
+void uring_write(int fd, const char *buf, unsigned len);
+/*
+ * Same for the count buffers in iov, len bytes in total. The iovec
+ * array has to stay valid until uring_flush() as well.
+ */
+void uring_writev(int fd, const struct iovec *iov, int count, unsigned len);
+/*
+ * Submit the queued writes and wait for all of them to complete
+ */
+void uring_flush(void);
+/*
+ * Log the write counters
+ */
+void uring_stats(void);
+
+#endif
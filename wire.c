@@ -0,0 +1,239 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Binary records: the client side encoding and the decoding of the
+ * values, see wire.h.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+static const char *VERSION __attribute__ ((used)) = "$Id$";
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "wire.h"
+#include "scan.h"
+
+/*
+ * Is the text of the field the canonical form of the address in addr?
+ * (so that it comes back the same on the other side)
+ */
+static int is_address(int family, const char *field, int len, void *addr) {
+    char text[INET6_ADDRSTRLEN], back[INET6_ADDRSTRLEN];
+
+    if (len >= INET6_ADDRSTRLEN) {
+        return 0;
+    }
+    memcpy(text, field, len);
+    text[len] = '\0';
+    return inet_pton(family, text, addr) == 1
+        && inet_ntop(family, addr, back, sizeof(back))
+        && !strcmp(text, back);
+}
+
+/*
+ * Encode one field. Returns the end of the output or NULL if it does
+ * not fit.
+ */
+static char *encode_value(wire_dict *dict, const char *field, int len,
+                          char *out, char *end) {
+    unsigned char addr[16];
+    unsigned n;
+    int i;
+
+    if (len == 1 && *field == '-') {
+        if (out >= end) {
+            return NULL;
+        }
+        *out++ = WIRE_NONE;
+        return out;
+    }
+
+    /* numbers that print back the same: no sign, no leading zeros */
+    if (len && len <= 9 && (field[0] != '0' || len == 1)) {
+        for (i = 0, n = 0; i < len && (unsigned) (field[i] - '0') < 10; i++) {
+            n = n * 10 + (field[i] - '0');
+        }
+        if (i == len) {
+            if (out >= end) {
+                return NULL;
+            }
+            *out++ = WIRE_UINT;
+            return wire_put_uint(out, end, n);
+        }
+    }
+
+    if (len >= 7 && (unsigned) (field[0] - '0') < 10
+        && is_address(AF_INET, field, len, addr)) {
+        if (end - out < 5) {
+            return NULL;
+        }
+        *out++ = WIRE_IPV4;
+        memcpy(out, addr, 4);
+        return out + 4;
+    }
+    if (len >= 2 && memchr(field, ':', len)
+        && is_address(AF_INET6, field, len, addr)) {
+        if (end - out < 17) {
+            return NULL;
+        }
+        *out++ = WIRE_IPV6;
+        memcpy(out, addr, 16);
+        return out + 16;
+    }
+
+    if (len >= WIRE_DICT_MIN) {
+        for (i = 0; i < dict->count; i++) {
+            if (dict->len[i] == len && !memcmp(dict->str[i], field, len)) {
+                if (out >= end) {
+                    return NULL;
+                }
+                *out++ = WIRE_REF;
+                return wire_put_uint(out, end, i);
+            }
+        }
+    }
+    if (out >= end) {
+        return NULL;
+    }
+    *out++ = WIRE_STR;
+    if (!(out = wire_put_uint(out, end, len)) || end - out < len) {
+        return NULL;
+    }
+    memcpy(out, field, len);
+    if (len >= WIRE_DICT_MIN && dict->count < WIRE_DICT) {
+        dict->str[dict->count] = out;
+        dict->len[dict->count++] = len;
+    }
+    return out + len;
+}
+
+int wire_encode(wire_dict *dict, const char *line, int length, char *out,
+                int size) {
+    int end[WIRE_FIELDS];
+    int n, i, start, count = dict->count;
+    char *op = out, *op_end = out + size;
+
+    if ((n = scan_sep(line, length, '\t', end, WIRE_FIELDS)) == WIRE_FIELDS) {
+        return -1;
+    }
+    end[n++] = length;
+    if (!(op = wire_put_uint(op, op_end, n))) {
+        return -1;
+    }
+    for (i = 0, start = 0; i < n; start = end[i++] + 1) {
+        if (!(op = encode_value(dict, line + start, end[i] - start, op,
+                                op_end))) {
+            dict->count = count;
+            return -1;
+        }
+    }
+    return op - out;
+}
+
+void wire_start(wire_reader *r, const char *data, int length) {
+    r->pos = data;
+    r->end = data + length;
+    r->dict.count = 0;
+}
+
+int wire_next(wire_reader *r, wire_value *v) {
+    unsigned n;
+
+    if (r->pos >= r->end) {
+        return -1;
+    }
+    v->tag = *r->pos++;
+    switch (v->tag) {
+    case WIRE_NONE:
+        return 0;
+
+    case WIRE_UINT:
+        return wire_get_uint(r, &v->number);
+
+    case WIRE_IPV4:
+    case WIRE_IPV6:
+        v->len = (v->tag == WIRE_IPV4) ? 4 : 16;
+        if (r->end - r->pos < v->len) {
+            return -1;
+        }
+        v->str = r->pos;
+        r->pos += v->len;
+        return 0;
+
+    case WIRE_STR:
+        if (wire_get_uint(r, &n) || n > (unsigned) (r->end - r->pos)) {
+            return -1;
+        }
+        v->str = r->pos;
+        v->len = n;
+        r->pos += n;
+        if (v->len >= WIRE_DICT_MIN && r->dict.count < WIRE_DICT) {
+            r->dict.str[r->dict.count] = v->str;
+            r->dict.len[r->dict.count++] = v->len;
+        }
+        return 0;
+
+    case WIRE_REF:
+        if (wire_get_uint(r, &n) || n >= (unsigned) r->dict.count) {
+            return -1;
+        }
+        v->tag = WIRE_STR;
+        v->str = r->dict.str[n];
+        v->len = r->dict.len[n];
+        return 0;
+    }
+    return -1;
+}
+
+int wire_text(const wire_value *v, char *out, int size) {
+    switch (v->tag) {
+    case WIRE_NONE:
+        if (size < 2) {
+            return -1;
+        }
+        strcpy(out, "-");
+        return 1;
+
+    case WIRE_UINT:
+        return (snprintf(out, size, "%u", v->number) < size)
+            ? (int) strlen(out) : -1;
+
+    case WIRE_IPV4:
+    case WIRE_IPV6:
+        if (!inet_ntop((v->tag == WIRE_IPV4) ? AF_INET : AF_INET6, v->str,
+                       out, size)) {
+            return -1;
+        }
+        return strlen(out);
+
+    case WIRE_STR:
+        if (v->len >= size) {
+            return -1;
+        }
+        memcpy(out, v->str, v->len);
+        out[v->len] = '\0';
+        return v->len;
+    }
+    return -1;
+}
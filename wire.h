@@ -0,0 +1,155 @@
+/*
+ * Copyright (C)2026 Laurentiu Badea     sourceforge.net/users/wotevah
+ *
+ * Author:   Laurentiu C. Badea (L.C.) sourceforge.net/users/wotevah
+ * Created:  Oct 17, 2026
+ * $LastChangedDate$
+ * $LastChangedBy$
+ * $Revision$
+ *
+ * Description:
+ * Binary records (httpd-logger --binary). The client splits the lines
+ * into their fields and sends each field as a tagged value, so the
+ * server fills in the log entries without scanning the lines:
+ *
+ *   datagram: FRAME_MARK FRAME_BINARY count(2 bytes, network order)
+ *             record...
+ *   record:   fields(varint) value...
+ *   value:    WIRE_NONE                  "-"
+ *             WIRE_UINT varint           a decimal number
+ *             WIRE_IPV4 4 bytes          an IP address
+ *             WIRE_IPV6 16 bytes
+ *             WIRE_STR length(varint) bytes
+ *             WIRE_REF index(varint)     the index-th string of the datagram
+ *
+ * The strings of at least WIRE_DICT_MIN bytes are numbered in the order
+ * they appear in the datagram, up to WIRE_DICT of them, and a string seen
+ * before is sent as a reference (the vhost, referrer and user agent of
+ * the lines packed together are often the same). The numbering starts
+ * over in every datagram, so a datagram lost does not matter.
+ * The varints are 7 bits per byte, low bits first.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * Version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef __WIRE_H__
+#define __WIRE_H__
+
+enum {
+    WIRE_NONE,
+    WIRE_UINT,
+    WIRE_IPV4,
+    WIRE_IPV6,
+    WIRE_STR,
+    WIRE_REF
+};
+
+#define WIRE_HEADER 4    /* FRAME_MARK FRAME_BINARY count  */
+#define WIRE_FIELDS 64   /* most fields in a record        */
+#define WIRE_DICT 64     /* most strings numbered          */
+#define WIRE_DICT_MIN 4  /* shorter strings are not       */
+#define WIRE_MIN_RECORD 1 /* a record with no fields      */
+
+/*
+ * The strings numbered so far in a datagram
+ */
+typedef struct {
+    const char *str[WIRE_DICT];
+    int len[WIRE_DICT];
+    int count;
+} wire_dict;
+
+/*
+ * Reading a datagram
+ */
+typedef struct {
+    const char *pos, *end;
+    wire_dict dict;
+} wire_reader;
+
+/*
+ * One value. Strings (and references) are WIRE_STR in str/len, the
+ * addresses are their bytes in str/len.
+ */
+typedef struct {
+    int tag;
+    unsigned number;
+    const char *str;
+    int len;
+} wire_value;
+
+static inline char *wire_put_uint(char *out, char *end, unsigned n) {
+    for (; n >= 0x80; n >>= 7) {
+        if (out >= end) {
+            return NULL;
+        }
+        *out++ = (n & 0x7f) | 0x80;
+    }
+    if (out >= end) {
+        return NULL;
+    }
+    *out++ = n;
+    return out;
+}
+
+/*
+ * Returns 0, or -1 past the end or for more than 32 bits
+ */
+static inline int wire_get_uint(wire_reader *r, unsigned *n) {
+    unsigned char b;
+    int shift;
+
+    for (*n = 0, shift = 0; shift < 35; shift += 7) {
+        if (r->pos >= r->end) {
+            return -1;
+        }
+        b = *r->pos++;
+        if (shift == 28 && b > 0x0f) {
+            return -1;
+        }
+        *n |= (unsigned) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Encode the record of a line (length bytes, without the '\n') at out
+ * (size bytes), adding its strings to dict. Returns the length of the
+ * record, or -1 if it does not fit or has too many fields (then dict
+ * is as it was).
+ */
+int wire_encode(wire_dict *dict, const char *line, int length, char *out,
+                int size);
+
+/*
+ * Start reading the records of a datagram (after the header)
+ */
+void wire_start(wire_reader *r, const char *data, int length);
+
+/*
+ * Read the next value. Returns 0, or -1 if the datagram is not valid.
+ */
+int wire_next(wire_reader *r, wire_value *v);
+
+/*
+ * Write the text of a value at out, '\0' terminated. Returns its length,
+ * or -1 if it does not fit in size bytes.
+ */
+int wire_text(const wire_value *v, char *out, int size);
+
+#endif